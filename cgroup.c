@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+
+char cgroup_dir[PATH_MAX]; /* the cgroup of cgroup_enter(), empty if none */
+int  cgroup_spawn;         /* move only children spawned by envmod into the cgroup, not envmod itself */
+
+
+/* the files of a cgroup always exist, a missing one is a mistyped path or a missing controller */
+static int writefile(const char *path, const char *value, int append) {
+	int     fd;
+	ssize_t len = strlen(value), ret;
+
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC | (append ? O_APPEND : O_TRUNC))) == -1)
+		return -1;
+	ret = write(fd, value, len);
+	close(fd);
+	return ret == len ? 0 : -1;
+}
+
+/* enable the controller of every setting in the ancestors of path, from top to bottom.
+ * Only directories with a `cgroup.subtree_control` are considered part of the hierarchy. */
+static void cgroup_enable(const char *path, char **settings, int nsettings) {
+	char        dir[PATH_MAX], file[PATH_MAX + 32], ctrl[64];
+	const char *end, *dot;
+
+	for (end = strchr(path + 1, '/'); end; end = strchr(end + 1, '/')) {
+		snprintf(dir, sizeof(dir), "%.*s", (int) (end - path), path);
+		snprintf(file, sizeof(file), "%s/cgroup.subtree_control", dir);
+		if (access(file, W_OK) == -1)
+			continue;
+
+		for (int i = 0; i < nsettings; i++) {
+			if ((dot = strchr(settings[i], '.')) == NULL || !strncmp(settings[i], "cgroup.", 7))
+				continue;
+			snprintf(ctrl, sizeof(ctrl), "+%.*s", (int) (dot - settings[i]), settings[i]);
+			if (writefile(file, ctrl, 1) == -1 && verbose)
+				FAIL_ERRNO(-1, "unable to enable controller `%s` in `%s`", ctrl + 1, dir);
+		}
+	}
+}
+
+/* move into the cgroup at path, created if missing, after applying each `file=value` of settings */
+void cgroup_enter(const char *path, char **settings, int nsettings) {
+	char  leaf[PATH_MAX], file[PATH_MAX + 32], pid[16], *sep;
+	char *value;
+
+	if (path[0] == '/')
+		snprintf(leaf, sizeof(leaf), "%s", path);
+	else
+		snprintf(leaf, sizeof(leaf), "%s/%s", CGROUP_ROOT, path);
+
+	for (sep = strchr(leaf + 1, '/');; sep = strchr(sep + 1, '/')) {
+		if (sep)
+			*sep = '\0';
+		if (mkdir(leaf, 0755) == -1 && errno != EEXIST)
+			FAIL_ERRNO(101, "unable to create cgroup `%s`", leaf);
+		if (!sep)
+			break;
+		*sep = '/';
+	}
+
+	cgroup_enable(leaf, settings, nsettings);
+
+	for (int i = 0; i < nsettings; i++) {
+		if ((value = strchr(settings[i], '=')) == NULL) {
+			fprintf(stderr, "%s: invalid cgroup setting `%s`, expected file=value\n", self, settings[i]);
+			exit(100);
+		}
+		snprintf(file, sizeof(file), "%s/%.*s", leaf, (int) (value - settings[i]), settings[i]);
+		if (writefile(file, value + 1, 0) == -1)
+			FAIL_ERRNO(101, "unable to set cgroup `%s`", settings[i]);
+	}
+
+	snprintf(cgroup_dir, sizeof(cgroup_dir), "%s", leaf);
+	snprintf(file, sizeof(file), "%s/cgroup.procs", leaf);
+
+	if (cgroup_spawn) {
+		/* opened now, the permission to move is checked against our credentials before dropping them */
+		if ((spawn_cgroupfd = movefd(open(file, O_WRONLY | O_CLOEXEC), 1)) == -1)
+			FAIL_ERRNO(101, "unable to open cgroup `%s`", leaf);
+		return;
+	}
+
+	snprintf(pid, sizeof(pid), "%d", getpid());
+	if (writefile(file, pid, 0) == -1)
+		FAIL_ERRNO(101, "unable to enter cgroup `%s`", leaf);
+}
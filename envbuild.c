@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <stdint.h>
+
+#define ENV_ARENA_BLOCK (64 * 1024)
+
+
+/* a variable refers to its `name=value` pair, either borrowed or copied into the arena */
+struct envvar {
+	const char *name; /* the pair which introduced the name, outlives unsetting */
+	size_t      namelen;
+	const char *pair; /* NULL if unset */
+};
+
+struct arenablock {
+	struct arenablock *next;
+	size_t             used, size;
+	char               data[];
+};
+
+static struct envvar     *vars;
+static size_t             nvars, varsalloc;
+static uint32_t          *slots; /* index into vars plus one, 0 if empty */
+static size_t             nslots;
+static struct arenablock *arena;
+
+/* receives the changes made by envdirs and envfiles while a profile is compiled, value is NULL if unset */
+void (*env_recorder)(const char *name, size_t namelen, const char *value, size_t valuelen);
+
+
+static uint32_t env_hash(const char *name, size_t len) {
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static char *arena_alloc(size_t size) {
+	struct arenablock *block;
+	size_t             blocksize;
+
+	if (arena == NULL || arena->size - arena->used < size) {
+		blocksize = size > ENV_ARENA_BLOCK ? size : ENV_ARENA_BLOCK;
+		if ((block = malloc(sizeof(*block) + blocksize)) == NULL) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		block->next = arena;
+		block->used = 0;
+		block->size = blocksize;
+		arena       = block;
+	}
+	arena->used += size;
+	return arena->data + arena->used - size;
+}
+
+/* find the slot of name, which is either empty or holds the variable */
+static uint32_t *env_slot(const char *name, size_t len) {
+	size_t         mask = nslots - 1;
+	size_t         i    = env_hash(name, len) & mask;
+	struct envvar *var;
+
+	for (;; i = (i + 1) & mask) {
+		if (slots[i] == 0)
+			return &slots[i];
+		var = &vars[slots[i] - 1];
+		if (var->namelen == len && memcmp(var->name, name, len) == 0)
+			return &slots[i];
+	}
+}
+
+static void env_grow(void) {
+	uint32_t      *oldslots = slots;
+	size_t         oldsize  = nslots;
+	struct envvar *newvars;
+
+	if (nvars == varsalloc) {
+		varsalloc = varsalloc ? varsalloc * 2 : 256;
+		if ((newvars = realloc(vars, varsalloc * sizeof(*vars))) == NULL) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		vars = newvars;
+	}
+
+	/* keep the table at most half full */
+	if ((nvars + 1) * 2 <= nslots)
+		return;
+
+	nslots = nslots ? nslots * 2 : 512;
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL) {
+		FAIL_ERRNO(102, "unable to allocate memory");
+	}
+	for (size_t i = 0; i < oldsize; i++) {
+		if (oldslots[i] != 0)
+			*env_slot(vars[oldslots[i] - 1].name, vars[oldslots[i] - 1].namelen) = oldslots[i];
+	}
+	free(oldslots);
+}
+
+/* insert or replace the variable named by the first namelen bytes of pair */
+static void env_insert(const char *pair, size_t namelen) {
+	uint32_t *slot;
+
+	if (namelen == 0 || memchr(pair, '=', namelen) != NULL)
+		return;
+
+	env_grow();
+	slot = env_slot(pair, namelen);
+	if (*slot == 0) {
+		vars[nvars].name    = pair;
+		vars[nvars].namelen = namelen;
+		*slot               = ++nvars;
+	}
+	vars[*slot - 1].pair = pair;
+}
+
+/* load the initial environment, the strings are borrowed and not copied */
+void env_init(char **initial) {
+	const char *sep;
+
+	for (; *initial; initial++) {
+		if ((sep = strchr(*initial, '=')) == NULL)
+			continue;
+		/* like getenv(3), the first occurrence of a name wins */
+		if (nslots > 0 && *env_slot(*initial, sep - *initial) != 0)
+			continue;
+		env_insert(*initial, sep - *initial);
+	}
+}
+
+/* set a `name=value` pair, the string is borrowed and must outlive the builder */
+void env_put(const char *pair) {
+	const char *sep;
+
+	if ((sep = strchr(pair, '=')) != NULL)
+		env_insert(pair, sep - pair);
+}
+
+void env_set(const char *name, size_t namelen, const char *value, size_t valuelen) {
+	char *pair = arena_alloc(namelen + valuelen + 2);
+
+	if (env_recorder)
+		env_recorder(name, namelen, value, valuelen);
+
+	memcpy(pair, name, namelen);
+	pair[namelen] = '=';
+	memcpy(pair + namelen + 1, value, valuelen);
+	pair[namelen + valuelen + 1] = '\0';
+
+	env_insert(pair, namelen);
+}
+
+void env_unset(const char *name, size_t namelen) {
+	uint32_t *slot;
+
+	if (env_recorder)
+		env_recorder(name, namelen, NULL, 0);
+
+	if (nslots == 0)
+		return;
+
+	if (*(slot = env_slot(name, namelen)) != 0)
+		vars[*slot - 1].pair = NULL;
+}
+
+const char *env_get(const char *name) {
+	size_t    len = strlen(name);
+	uint32_t *slot;
+
+	if (nslots == 0 || *(slot = env_slot(name, len)) == 0 || vars[*slot - 1].pair == NULL)
+		return NULL;
+
+	return vars[*slot - 1].pair + len + 1;
+}
+
+/* unset every variable except the ones in keep */
+void env_keep(char **keep, int nkeep) {
+	const char **kept;
+	uint32_t    *slot;
+
+	if ((kept = calloc(nkeep, sizeof(*kept))) == NULL && nkeep > 0) {
+		FAIL_ERRNO(102, "unable to allocate memory");
+	}
+
+	for (int i = 0; i < nkeep; i++) {
+		if (nslots > 0 && *(slot = env_slot(keep[i], strlen(keep[i]))) != 0)
+			kept[i] = vars[*slot - 1].pair;
+		if (kept[i] == NULL)
+			fprintf(stderr, "%s: unknown environ-var '%s'\n", self, keep[i]);
+	}
+
+	for (size_t i = 0; i < nvars; i++)
+		vars[i].pair = NULL;
+
+	for (int i = 0; i < nkeep; i++) {
+		if (kept[i] != NULL)
+			env_put(kept[i]);
+	}
+
+	free(kept);
+}
+
+/* materialise the environment as one contiguous envp */
+char **env_build(void) {
+	char **envp;
+	size_t n = 0;
+
+	if ((envp = malloc((nvars + 1) * sizeof(*envp))) == NULL) {
+		FAIL_ERRNO(102, "unable to allocate memory");
+	}
+	for (size_t i = 0; i < nvars; i++) {
+		if (vars[i].pair != NULL)
+			envp[n++] = (char *) vars[i].pair;
+	}
+	envp[n] = NULL;
+
+	return envp;
+}
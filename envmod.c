@@ -1,14 +1,12 @@
 #define _GNU_SOURCE
 
 #include "arg.h"
+#include "envmod.h"
 #include "signames.h"
 
-#include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
-#include <linux/limits.h>
-#include <pwd.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,197 +18,14 @@
 
 #define DEFAULT_SHELL "sh"
 
-#define ENVFILE_MAX 16
-#define KEEPENV_MAX 64
+#define ENVFILE_MAX   16
+#define KEEPENV_MAX   64
+#define CGROUPSET_MAX 16
 
-#define FAIL_ERRNO(exitcode, fmt, ...) \
-	(fprintf(stderr, "%s: " fmt ": %s\n", self, ##__VA_ARGS__, strerror(errno)), exitcode > -1 ? exit(exitcode) : 0)
 
+char *self;
+int   verbose = 0;
 
-extern char      **environ;
-static int         sigign[NSIG];
-static const char *sigtrap[NSIG];
-static pid_t       pid;
-static char       *self;
-
-
-/* uid:gid[:gid[:gid]...] */
-static int parse_ugid_num(char *str, uid_t *uid, gid_t *gids) {
-	int   i = 0;
-	char *end;
-
-	*uid = strtoul(str, &end, 10);
-	if (*end != ':') {
-		gids[0] = *uid;
-		return 1;
-	}
-
-	str = end + 1;
-
-	while (i < 60) {
-		gids[i++] = strtoul(str, &end, 10);
-
-		if (*end != ':')
-			break;
-
-		str = end + 1;
-	}
-
-	if (*end != '\0') {
-		fprintf(stderr, "%s: expected end in uidgid, got %c\n", self, *end);
-		exit(100);
-	}
-
-	return i;
-}
-
-static int parse_ugid(char *str, uid_t *uid, gid_t *gids) {
-	struct passwd *pwd;
-	struct group  *gr;
-	char          *end;
-	char          *groupstr = NULL;
-	int            gid_size = 0;
-	char          *next;
-
-	if (str[0] == ':')
-		return parse_ugid_num(str + 1, uid, gids);
-
-	if ((end = strchr(str, ':')) != NULL) {
-		end[0]   = '\0';
-		groupstr = end + 1;
-	}
-
-	if ((pwd = getpwnam(str)) == NULL) {
-		fprintf(stderr, "%s: unknown user: %s\n", self, str);
-		exit(101);
-	}
-	*uid = pwd->pw_uid;
-
-	if (groupstr == NULL) {
-		gids[0] = pwd->pw_gid;
-		return 1;
-	}
-
-	next = groupstr;
-
-	while (next && gid_size < 60) {
-		groupstr = next;
-		if ((end = strchr(groupstr, ':')) != NULL) {
-			end[0] = '\0';
-			next   = end + 1;
-		} else {
-			next = NULL;
-		}
-		if ((gr = getgrnam(groupstr)) == NULL) {
-			fprintf(stderr, "%s: unknown group: %s\n", self, groupstr);
-			exit(101);
-		}
-		gids[gid_size++] = gr->gr_gid;
-	}
-
-	return gid_size;
-}
-
-static char *strip(char *text, size_t size) {
-	while (size > 0 && isspace(text[0])) {
-		text++, size--;
-	}
-	while (size > 0 && isspace(text[size] - 1)) {
-		size--;
-	}
-	text[size] = '\0';
-	return text;
-}
-
-static char *nicevar(char *text, size_t size) {
-	text = strip(text, size);
-
-	for (size_t i = 0; i < size; i++) {
-		if (text[i] == '=') {
-			fprintf(stderr, "'=' in envfile: %s\n", text);
-			return NULL;
-		}
-		if (text[i] == '\0') {
-			text[i] = '\n';
-		}
-	}
-
-	return text;
-}
-
-static void parse_envdir(const char *path) {
-	DIR           *dir;
-	FILE          *fp;
-	struct dirent *entry;
-	char           entrypath[PATH_MAX], *envval = NULL, *newval;
-	long           envvalalloc = 0, size;
-
-	if (!(dir = opendir(path))) {
-		FAIL_ERRNO(101, "unable to open envdir `%s`", path);
-	}
-
-	while ((entry = readdir(dir)) != NULL) {
-		if (entry->d_name[0] == '.')
-			continue;
-		snprintf(entrypath, PATH_MAX, "%s/%s", path, entry->d_name);
-		if ((fp = fopen(entrypath, "r")) == NULL) {
-			FAIL_ERRNO(-1, "unable to open `%s`", entrypath);
-			continue;
-		}
-		fseek(fp, 0, SEEK_END);
-		size = ftell(fp);
-		if (size == 0) {
-			unsetenv(entry->d_name);
-		} else {
-			rewind(fp);
-			if (size + 1 > envvalalloc) {
-				if ((newval = realloc(envval, size + 1)) == NULL) {
-					FAIL_ERRNO(102, "unable to allocate memory");
-				}
-				envval      = newval;
-				envvalalloc = size + 1;
-			}
-			fread(envval, size, 1, fp);
-			if ((newval = nicevar(envval, size)) != NULL) {
-				setenv(entry->d_name, newval, 1);
-			}
-		}
-		fclose(fp);
-	}
-	if (envval != NULL)
-		free(envval);
-
-	closedir(dir);
-}
-
-static void parse_envfile(const char *path) {
-	FILE   *fp;
-	char   *line       = NULL, *value;
-	size_t  line_alloc = 0;
-	ssize_t line_len;
-
-	if ((fp = fopen(path, "r")) == NULL) {
-		FAIL_ERRNO(101, "unable to open envfile `%s`", path);
-	}
-
-	while ((line_len = getline(&line, &line_alloc, fp)) > 0) {
-		line  = strip(line, line_len);
-		value = strchr(line, '=');
-		if (!value)
-			continue;
-
-		*(value++) = '\0';
-		if (value[0] == '\0') {
-			unsetenv(line);
-		} else {
-			setenv(line, value, 1);
-		}
-	}
-
-	if (line)
-		free(line);
-	fclose(fp);
-}
 
 static void limit(int what, long l) {
 	struct rlimit r;
@@ -229,13 +44,31 @@ static void limit(int what, long l) {
 		FAIL_ERRNO(102, "unable to set rlimit");
 }
 
-static char *shellname(void) {
+char *shellname(void) {
 	char *name = getenv("SHELL");
 	if (name)
 		return name;
 	return DEFAULT_SHELL;
 }
 
+/* move fd to FD_MIN or above, fd is closed either way, returns -1 on failure */
+int movefd(int fd, int cloexec) {
+	int moved, err;
+
+	if (fd == -1)
+		return -1;
+	moved = fcntl(fd, cloexec ? F_DUPFD_CLOEXEC : F_DUPFD, FD_MIN);
+	err   = errno;
+	close(fd);
+	errno = err;
+	return moved;
+}
+
+static void toomany(char opt, int max) {
+	fprintf(stderr, "%s: option -%c can be given at most %d times\n", self, opt, max);
+	exit(100);
+}
+
 static void usage() {
 	fprintf(stderr, "usage: envmod [options] prog [arguments...]\n"
 	                "       softlimit [options] prog [arguments...]\n"
@@ -248,53 +81,35 @@ static void usage() {
 	exit(100);
 }
 
-static void signal_handler(int signo) {
-	if (signo == SIGCHLD)
-		return;
-
-	if (sigtrap[signo]) {
-		char        signo_str[10];
-		const char *shell = shellname();
-		snprintf(signo_str, sizeof(signo_str), "%d", signo);
-
-		pid_t shellpid;
-		while ((shellpid = fork()) == -1) {
-			FAIL_ERRNO(-1, "unable to fork, retrying");
-			sleep(1);
-		}
-
-		if (shellpid == 0) {
-			setenv("signo", signo_str, 1);
-			setenv("signame", signum_to_signame(signo), 1);
-			execlp(shell, shell, "-c", sigtrap[signo], NULL);
-			FAIL_ERRNO(0, "unable to execute shell");
-			_exit(127);
-		}
-	}
-
-	if (sigign[signo])
-		return;
-
-	kill(pid, signo);
-}
-
 int main(int argc, char **argv) {
-	int   lockfd, lockfdflags = 0, lockflags = 0, locktimeout = 0, gid_len = 0, envgid_len = 0, useshell = 0;
+	int   lockfdflags = 0, lockflags = 0, gid_len = 0, envgid_len = 0, useshell = 0;
+	long  locktimeout = 0;
+	int   lockslots   = 0;
 	char *arg0 = NULL, *root = NULL, *cd = NULL, *lock = NULL, *exec = NULL;
 	char *envdirpath[ENVFILE_MAX], *envfilepath[ENVFILE_MAX], *modenv[KEEPENV_MAX];
+	int   envdircache[ENVFILE_MAX];
 	int   dofork         = 0;
+	int   dojobs = 0, jobs = 0, jobsordered = 0;
+	char  nojobs = 0; /* an option for a single prog, e.g. implemented by the supervisor which -j does not run */
+	char *cgroup = NULL, *cgroupset[CGROUPSET_MAX];
+	int   cgroupset_len = 0;
+	char *cpus = NULL, *memnodes = NULL, *schedule = NULL, *memory = NULL;
+	char *sockets[LISTEN_MAX];
+	int   sockets_len = 0;
+	char *jobspath = NULL, *end;
 	int   envdirpath_len = 0, envfilepath_len = 0, modenv_len = 0;
 	int   setuser = 0, setenvuser = 0, clearenviron = 0, setenvargs = 0;
+	char *userspec = NULL, *envuserspec = NULL;
 	uid_t uid, envuid;
-	gid_t gid[61], envgid[61];
+	gid_t *gid = NULL, *envgid = NULL;
 	long  limitd = -2, limits = -2, limitl = -2, limita = -2, limito = -2, limitp = -2, limitf = -2, limitc = -2,
 	     limitr = -2, limitt = -2;
 	long nicelevel = 0;
 	int  ssid      = 0;
-	int  verbose   = 0;
 	int  closefd[10];
 	for (int i = 0; i < 10; i++)
 		closefd[i] = 0;
+	trace_start();
 	self = strrchr(argv[0], '/');
 	if (self == NULL)
 		self = argv[0];
@@ -306,19 +121,23 @@ int main(int argc, char **argv) {
 	for (int i = 0; i < NSIG; i++)
 		sigtrap[i] = NULL;
 
+	env_init(environ);
+	jobserver_init();
+
 	if (!strcmp(self, "setuidgid") || !strcmp(self, "envuidgid")) {
 		if (argc < 2) {
 			fprintf(stderr, "%s <uid-gid> command...", self);
 			return 100;
 		}
 		setuser++;
-		gid_len = parse_ugid(argv[1], &uid, gid);
+		userspec = argv[1];
 		argv += 2, argc -= 2;
 	} else if (!strcmp(self, "envdir")) {
 		if (argc < 2) {
 			fprintf(stderr, "%s <uid-gid> command...", self);
 			return 100;
 		}
+		envdircache[envdirpath_len]  = 0;
 		envdirpath[envdirpath_len++] = argv[1];
 		argv += 2, argc -= 2;
 	} else if (!strcmp(self, "pgrphack")) {
@@ -434,7 +253,7 @@ int main(int argc, char **argv) {
 				verbose++;
 				break;
 			case 'w':
-				locktimeout = (int) (1000.0 * atof(EARGF(usage())));
+				locktimeout = (long) (1000000.0 * atof(EARGF(usage())));
 				break;
 			case 'E':
 			case 'F':
@@ -446,26 +265,39 @@ int main(int argc, char **argv) {
 				usage();
 		}
 		ARGEND
+		lock = argv[0];
+		SHIFT;
 	} else {
-		if (strcmp(self, "envmod") && strcmp(self, "chpst"))
+		/* also envmod-static and the like */
+		if (strncmp(self, "envmod", 6) && strcmp(self, "chpst"))
 			fprintf(stderr, "warning: program-name unsupported, assuming `envmod`\n");
 
+		if (argc > 2 && !strcmp(argv[1], "-@"))
+			profile_load(argv[2], &argc, &argv);
+
 		ARGBEGIN
 		switch (OPT) {
 			case 'u':
 				setuser++;
-				if ((gid_len = parse_ugid(EARGF(usage()), &uid, gid)) == -1) {
-					return -1;
-				}
+				userspec = EARGF(usage());
 				break;
 			case 'U':
 				setenvuser++;
-				if ((envgid_len = parse_ugid(EARGF(usage()), &envuid, envgid)) == -1) {
-					return -1;
-				}
+				envuserspec = EARGF(usage());
+				break;
+			case 'N':
+				ugid_files++;
+				break;
+			case 'K':
+				ugid_cache    = EARGF(usage());
+				ugid_cachettl = atol(EARGF(usage()));
+				break;
+			case 'G':
+				ugid_initgroups++;
 				break;
 			case 'b':
-				arg0 = EARGF(usage());
+				nojobs = OPT;
+				arg0   = EARGF(usage());
 				break;
 			case '/':
 				root = EARGF(usage());
@@ -484,7 +316,43 @@ int main(int argc, char **argv) {
 				lock      = EARGF(usage());
 				lockflags = LOCK_EX;
 				break;
+			case 'w':
+				locktimeout = (long) (1000000.0 * atof(EARGF(usage())));
+				break;
+			case 'q':
+				lockslots = atoi(EARGF(usage()));
+				break;
+			case 'g':
+				cgroup = EARGF(usage());
+				break;
+			case 'R':
+				if (cgroupset_len == CGROUPSET_MAX)
+					toomany(OPT, CGROUPSET_MAX);
+				cgroupset[cgroupset_len++] = EARGF(usage());
+				break;
+			case 'A':
+				cpus = EARGF(usage());
+				break;
+			case 'H':
+				memnodes = EARGF(usage());
+				break;
+			case 'Q':
+				schedule = EARGF(usage());
+				break;
+			case 'X':
+				memory = EARGF(usage());
+				break;
+			case 'I':
+				if (sockets_len == LISTEN_MAX)
+					toomany(OPT, LISTEN_MAX);
+				sockets[sockets_len++] = EARGF(usage());
+				break;
 			case 'e':
+				envdircache[envdirpath_len]  = 0;
+				envdirpath[envdirpath_len++] = EARGF(usage());
+				break;
+			case 'B':
+				envdircache[envdirpath_len]  = 1;
 				envdirpath[envdirpath_len++] = EARGF(usage());
 				break;
 			case 'E':
@@ -510,10 +378,12 @@ int main(int argc, char **argv) {
 				break;
 			case 'i':
 				dofork++;
+				nojobs = OPT;
 				sigign[signame_to_signum(EARGF(usage()))]++;
 				break;
 			case 'T':
 				dofork++;
+				nojobs = OPT;
 				int         signo   = signame_to_signum(EARGF(usage()));
 				const char *command = EARGF(usage());
 
@@ -521,6 +391,55 @@ int main(int argc, char **argv) {
 				break;
 			case 'F':
 				dofork++;
+				nojobs = OPT;
+				break;
+			case 'W':
+				dofork++;
+				nojobs = OPT;
+				parse_prefork(EARGF(usage()));
+				break;
+			case 'z':
+				dofork++;
+				nojobs = OPT;
+				usage_parse(EARGF(usage()));
+				break;
+			case 'O':
+				dofork++;
+				nojobs = OPT;
+				logdir_parse(EARGF(usage()));
+				break;
+			case 'Y':
+				dofork++;
+				nojobs = OPT;
+				psi_parse(EARGF(usage()));
+				break;
+			case 'Z':
+				dofork++;
+				nojobs = OPT;
+				parse_timeout(EARGF(usage()));
+				break;
+			case 'D':
+				trace_parse(EARGF(usage()));
+				break;
+			case '@':
+				fprintf(stderr, "%s: a profile (-@) must be the first option\n", self);
+				usage();
+				break;
+			case 'y':
+				dofork++;
+				jobserver_parse(EARGF(usage()));
+				break;
+			case 'j':
+				dojobs++;
+				jobs = strtol(EARGF(usage()), &end, 10);
+				if (!strcmp(end, ",ordered"))
+					jobsordered++;
+				else if (*end != '\0')
+					usage();
+				break;
+			case 'J':
+				dojobs++;
+				jobspath = EARGF(usage());
 				break;
 			case 'm':
 				limits = limitl = limita = limitd = atol(EARGF(usage()));
@@ -558,18 +477,33 @@ int main(int argc, char **argv) {
 		setenvargs++;
 	}
 
+	trace_mark("args");
+
+	if (userspec) {
+		gid_len = parse_ugid(userspec, &uid, &gid);
+		profile_user(userspec, uid, gid, gid_len);
+	}
+
+	if (envuserspec) {
+		envgid_len = parse_ugid(envuserspec, &envuid, &envgid);
+		profile_user(envuserspec, envuid, envgid, envgid_len);
+	}
+
+	trace_mark("ugid");
+
 	if (setenvargs) {
-		while (argc > 0) {
-			char *value = strchr(argv[0], '=');
-			if (!value)
-				break;
-			*(value++) = '\0';
-			setenv(argv[0], value, 1);
+		while (argc > 0 && strchr(argv[0], '=') != NULL) {
+			env_put(argv[0]);
 			SHIFT;
 		}
 	}
 
-	if (argc == 0) {
+	if (dojobs && nojobs) {
+		fprintf(stderr, "%s: option -%c cannot be used with -j\n", self, nojobs);
+		usage();
+	}
+
+	if (argc == 0 && !dojobs) {
 		fprintf(stderr, "%s: command required\n", self);
 		usage();
 	}
@@ -580,6 +514,46 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (lockslots < 0 || (lockslots > 0 && !lock)) {
+		fprintf(stderr, "%s: -q requires a lock (-l or -L)\n", self);
+		usage();
+	}
+
+	if (cgroupset_len > 0 && !cgroup) {
+		fprintf(stderr, "%s: -R requires a cgroup (-g)\n", self);
+		usage();
+	}
+
+	if (cgroup)
+		cgroup_enter(cgroup, cgroupset, cgroupset_len);
+
+	psi_open();
+
+	trace_mark("cgroup");
+
+	/* real-time policies, merging and lowering the oom-score may require privileges we drop below */
+	if (schedule)
+		set_schedule(schedule, dofork || dojobs);
+
+	if (cpus)
+		place_cpus(cpus);
+
+	if (memnodes)
+		place_memory(memnodes);
+
+	if (memory)
+		set_memory(memory);
+
+	trace_mark("schedule");
+
+	/* bind before dropping privileges, so privileged ports work */
+	for (int i = 0; i < sockets_len; i++)
+		listen_open(sockets[i], prefork_workers ? prefork_count() : 1);
+
+	logdir_open();
+
+	trace_mark("sockets");
+
 	if (setuser) {
 		if (setgroups(gid_len, gid) == -1) {
 			FAIL_ERRNO(101, "unable to set groups");
@@ -591,22 +565,24 @@ int main(int argc, char **argv) {
 			FAIL_ERRNO(101, "unable to set user");
 		}
 
-		if (envuid == 0) {
+		if (!setenvuser) {
 			setenvuser++;
-			envuid     = uid;
-			envgid_len = gid_len;
-			memcpy(envgid, gid, sizeof(*gid) * gid_len);
+			envuid = uid;
+			envgid = gid;
 		}
 	}
 
 	if (setenvuser) {
-		char dest[10];
-		snprintf(dest, sizeof(dest), "%u", envuid);
-		setenv("UID", dest, 1);
-		snprintf(dest, sizeof(dest), "%u", envgid[0]);
-		setenv("GID", dest, 1);
+		char dest[12];
+		int  len;
+		len = snprintf(dest, sizeof(dest), "%u", envuid);
+		env_set("UID", 3, dest, len);
+		len = snprintf(dest, sizeof(dest), "%u", envgid[0]);
+		env_set("GID", 3, dest, len);
 	}
 
+	trace_mark("setuser");
+
 	if (root) {
 		if (chroot(root) == -1)
 			FAIL_ERRNO(101, "unable to change root-directory");
@@ -621,6 +597,8 @@ int main(int argc, char **argv) {
 			FAIL_ERRNO(101, "unable to change directory");
 	}
 
+	trace_mark("chroot");
+
 	if (nicelevel != 0) {
 		errno = 0;
 		/* don't check return-value, nice(2) states there are true negatives,
@@ -720,59 +698,57 @@ int main(int argc, char **argv) {
 #endif
 	}
 
-	if (lock) {
-		if ((lockfd = open(lock, lockfdflags | O_WRONLY | O_APPEND | O_CREAT, 0644)) == -1)
-			FAIL_ERRNO(101, "unable to open lockfile");
+	trace_mark("limits");
 
-		if (locktimeout)
-			ualarm(locktimeout * 1000, 0);
+	if (lock)
+		lockfile(lock, lockflags, lockfdflags, locktimeout, lockslots);
 
-		if (flock(lockfd, lockflags) == -1)
-			FAIL_ERRNO(101, "unable to lock file");
-
-		/* cancel alarm */
-		alarm(0);
-	}
+	trace_mark("lock");
 
 	if (clearenviron) {
-		if (modenv_len == 0) {
-			clearenv();
-		} else {
-			char **newenvion = malloc((modenv_len + 1) * sizeof(char *));
-			int    envlen    = 0;
-			for (int i = 0; i < modenv_len; i++) {
-				char *value = getenv(modenv[i]);
-				if (value == NULL) {
-					fprintf(stderr, "%s: unknown environ-var '%s'\n", self, modenv[i]);
-					continue;
-				}
-				char *pair = malloc(strlen(modenv[i]) + strlen(value) + 2);
-				sprintf(pair, "%s=%s", modenv[i], value);
-				newenvion[envlen++] = pair;
-			}
-			newenvion[envlen] = NULL;
-			environ           = newenvion;
-		}
+		env_keep(modenv, modenv_len);
 	} else {
 		for (int i = 0; i < modenv_len; i++) {
-			unsetenv(modenv[i]);
+			env_unset(modenv[i], strlen(modenv[i]));
 		}
 	}
 
+	/* the envdirs and envfiles of a compiled profile are applied as they were */
+	profile_env(PROFILE_ENVDIR);
 	for (int i = 0; i < envdirpath_len; i++) {
-		parse_envdir(envdirpath[i]);
+		profile_record(PROFILE_ENVDIR, envdirpath[i], root != NULL);
+		parse_envdir(envdirpath[i], envdircache[i]);
 	}
 
+	profile_env(PROFILE_ENVFILE);
 	for (int i = 0; i < envfilepath_len; i++) {
+		profile_record(PROFILE_ENVFILE, envfilepath[i], root != NULL);
 		parse_envfile(envfilepath[i]);
 	}
 
+	profile_save();
+
+	trace_mark("envdir");
+
+	listen_env();
+	lock_env();
+	jobserver_start();
+
+	environ = env_build();
+
 	for (int i = 0; i < 10; i++) {
 		if (closefd[i] && close(i) == -1) {
 			FAIL_ERRNO(101, "unable to close fd %d", i);
 		}
 	}
 
+	listen_pass();
+
+	trace_mark("environ");
+
+	if (dojobs)
+		return runjobs(jobspath, jobs, jobsordered, argv, argc, useshell);
+
 	exec = argv[0];
 	if (arg0)
 		argv[0] = arg0;
@@ -788,37 +764,12 @@ int main(int argc, char **argv) {
 	}
 
 	if (!dofork) {
+		trace_lookup(exec);
+		trace_end("exec");
 		execvpe(exec, argv, environ);
 		FAIL_ERRNO(127, "unable to execute");
 	}
 
-	for (int i = 0; i < NSIG; i++)
-		signal(i, signal_handler);
-
-	while ((pid = fork()) == -1) {
-		FAIL_ERRNO(-1, "unable to fork, retrying");
-		sleep(1);
-	}
-
-	if (pid == 0) {
-		execvpe(exec, argv, environ);
-		FAIL_ERRNO(-1, "unable to execute");
-		_exit(127);
-	}
-
-	int exitstat;
-	waitpid(pid, &exitstat, 0);
-	if (WIFEXITED(exitstat)) {
-		if (verbose)
-			fprintf(stderr, "%s: child exited %d\n", self, WEXITSTATUS(exitstat));
-		return WEXITSTATUS(exitstat);
-	}
-
-	if (WIFSIGNALED(exitstat)) {
-		fprintf(stderr, "%s: child terminated using %s\n", self, signum_to_signame(WTERMSIG(exitstat)));
-		return 120;
-	}
-
-	fprintf(stderr, "%s: child terminated\n", self);
-	return 121;
+	trace_end("spawn");
+	return supervise(exec, argv);
 }
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#define LISTEN_MAX 16 /* sockets of -I, passed at fd 3 and following */
+
+/* fds kept by envmod itself are moved here and above, out of the way of -0 to -9 and the sockets of -I */
+#define FD_MIN (3 + LISTEN_MAX)
+
+#define FAIL_ERRNO(exitcode, fmt, ...) \
+	(fprintf(stderr, "%s: " fmt ": %s\n", self, ##__VA_ARGS__, strerror(errno)), exitcode > -1 ? exit(exitcode) : 0)
+
+
+extern char      **environ;
+extern char       *self;
+extern int         verbose;
+extern int         sigign[];
+extern const char *sigtrap[];
+extern int         ugid_files;
+extern int         ugid_initgroups;
+extern const char *ugid_cache;
+extern long        ugid_cachettl;
+extern char       *spawn_pidvar;
+extern const int  *spawn_fds;
+extern int         spawn_nfds;
+extern int         spawn_setpgid;
+extern int         spawn_cgroupfd;
+extern int         spawn_logfd;
+extern char        cgroup_dir[];
+extern int         cgroup_spawn;
+extern int         prefork_workers;
+extern const char *usage_report;
+extern void (*env_recorder)(const char *name, size_t namelen, const char *value, size_t valuelen);
+
+char *shellname(void);
+int   movefd(int fd, int cloexec);
+
+/* cgroup.c */
+void cgroup_enter(const char *path, char **settings, int nsettings);
+
+/* loadenv.c */
+void parse_envdir(const char *path, int buildcache);
+void parse_envfile(const char *path);
+
+/* usage.c */
+struct iousage {
+	long long rchar, wchar, read_bytes, write_bytes;
+};
+
+void usage_parse(char *spec);
+void usage_open(void);
+void usage_readio(pid_t pid, struct iousage *io);
+void usage_print(int worker, pid_t pid, int status, double wall, const struct rusage *ru, const struct iousage *io);
+
+/* trace.c */
+void trace_start(void);
+void trace_parse(char *spec);
+void trace_mark(const char *name);
+void trace_lookup(const char *file);
+void trace_end(const char *name);
+
+/* profile.c */
+enum {
+	PROFILE_ENVDIR,
+	PROFILE_ENVFILE,
+	PROFILE_SECTIONS,
+};
+
+void profile_load(const char *path, int *argc, char ***argv);
+void profile_user(const char *spec, uid_t uid, const gid_t *gids, int ngids);
+void profile_record(int section, const char *path, int chrooted);
+void profile_fail(void);
+void profile_env(int section);
+void profile_save(void);
+
+/* ugid.c */
+#define PASSWD_PATH "/etc/passwd"
+#define GROUP_PATH  "/etc/group"
+
+/* a static binary cannot load NSS-modules, users and groups are always looked up in the files like with -N */
+#ifdef ENVMOD_STATIC
+#	define ugid_nss 0
+#else
+#	define ugid_nss (!ugid_files)
+#endif
+
+int parse_ugid(char *str, uid_t *uid, gid_t **gids);
+
+/* envbuild.c */
+void        env_init(char **initial);
+void        env_put(const char *pair);
+void        env_set(const char *name, size_t namelen, const char *value, size_t valuelen);
+void        env_unset(const char *name, size_t namelen);
+const char *env_get(const char *name);
+void        env_keep(char **keep, int nkeep);
+char      **env_build(void);
+
+/* logdir.c */
+void logdir_parse(char *spec);
+void logdir_open(void);
+void logdir_start(void);
+void logdir_flush(void);
+
+/* psi.c */
+void psi_parse(char *spec);
+void psi_open(void);
+void psi_start(void);
+void psi_stop(void);
+
+/* supervise.c */
+struct source {
+	int fd;
+	void (*handle)(struct source *src);
+};
+
+void supervise_watch(struct source *src, int events);
+void supervise_foreach(void (*fn)(pid_t pid));
+void settimer(int fd, double seconds);
+void parse_prefork(char *spec);
+void parse_timeout(char *spec);
+int  prefork_count(void);
+int  supervise(const char *exec, char **argv);
+
+/* jobs.c */
+int runjobs(const char *path, int workers, int ordered, char **prefix, int nprefix, int useshell);
+
+/* jobserver.c */
+void jobserver_init(void);
+void jobserver_parse(char *spec);
+void jobserver_start(void);
+
+/* lock.c */
+int  lockfile(const char *path, int flags, int fdflags, long timeout, int slots);
+void lock_env(void);
+
+/* memory.c */
+void set_memory(char *spec);
+
+/* placement.c */
+void place_cpus(char *spec);
+void place_memory(char *spec);
+
+/* schedule.c */
+void set_schedule(char *spec, int forking);
+
+/* sockets.c */
+void listen_open(char *spec, int workers);
+void listen_env(void);
+void listen_pass(void);
+void listen_worker(int worker);
+
+/* spawn.c */
+int   pidfd_open(pid_t pid);
+pid_t spawn(const char *file, char **argv, char **envp, const sigset_t *mask, int *pidfd, int tries);
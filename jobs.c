@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+#include "signames.h"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define JOBS_FAILED 123
+
+
+struct job {
+	size_t index;
+	pid_t  pid; /* 0 if the slot is free */
+	char  *line;
+};
+
+/* finished jobs waiting for their predecessors to be reported */
+struct pending {
+	char *line;
+	int   status;
+	int   done;
+};
+
+static struct pending *pending;
+static size_t          pendingbase = 1, pendingalloc; /* jobs are numbered from 1 */
+
+
+static void report(size_t index, const char *line, int status) {
+	if (WIFEXITED(status))
+		fprintf(stderr, "%s: job %zu exited %d: %s\n", self, index, WEXITSTATUS(status), line);
+	else if (WIFSIGNALED(status))
+		fprintf(stderr, "%s: job %zu terminated using %s: %s\n", self, index, signum_to_signame(WTERMSIG(status)),
+		        line);
+	else
+		fprintf(stderr, "%s: job %zu terminated: %s\n", self, index, line);
+}
+
+/* report a finished job in input order, the line is taken over */
+static void report_ordered(size_t index, char *line, int status) {
+	struct pending *newpending;
+	size_t          slot = index - pendingbase;
+
+	if (slot >= pendingalloc) {
+		size_t newalloc = pendingalloc ? pendingalloc * 2 : 64;
+		while (slot >= newalloc)
+			newalloc *= 2;
+		if ((newpending = realloc(pending, newalloc * sizeof(*pending))) == NULL) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		memset(newpending + pendingalloc, 0, (newalloc - pendingalloc) * sizeof(*pending));
+		pending      = newpending;
+		pendingalloc = newalloc;
+	}
+	pending[slot] = (struct pending) { line, status, 1 };
+
+	for (slot = 0; slot < pendingalloc && pending[slot].done; slot++) {
+		report(pendingbase + slot, pending[slot].line, pending[slot].status);
+		free(pending[slot].line);
+	}
+	if (slot > 0) {
+		memmove(pending, pending + slot, (pendingalloc - slot) * sizeof(*pending));
+		memset(pending + pendingalloc - slot, 0, slot * sizeof(*pending));
+		pendingbase += slot;
+	}
+}
+
+static pid_t startjob(char *line, char **prefix, int nprefix, int useshell) {
+	char  **argv, *word, *save, *script = NULL;
+	size_t  len = 0;
+	int     argc = 0;
+	pid_t   pid;
+
+	if ((argv = malloc((nprefix + strlen(line) / 2 + 4) * sizeof(*argv))) == NULL) {
+		FAIL_ERRNO(102, "unable to allocate memory");
+	}
+
+	if (useshell) {
+		/* the prefix and the line form one script */
+		for (int i = 0; i < nprefix; i++)
+			len += strlen(prefix[i]) + 1;
+		if ((script = malloc(len + strlen(line) + 1)) == NULL) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		script[0] = '\0';
+		for (int i = 0; i < nprefix; i++)
+			strcat(strcat(script, prefix[i]), " ");
+		strcat(script, line);
+
+		argv[argc++] = shellname();
+		argv[argc++] = "-c";
+		argv[argc++] = script;
+	} else {
+		for (int i = 0; i < nprefix; i++)
+			argv[argc++] = prefix[i];
+		for (word = strtok_r(line, " \t", &save); word; word = strtok_r(NULL, " \t", &save))
+			argv[argc++] = word;
+	}
+	argv[argc] = NULL;
+
+	pid = spawn(argv[0], argv, environ, NULL, NULL, 0);
+
+	free(script);
+	free(argv);
+	return pid;
+}
+
+/* run every line of path (or stdin if NULL) as a job, with at most `workers` running at once */
+int runjobs(const char *path, int workers, int ordered, char **prefix, int nprefix, int useshell) {
+	struct job *slots;
+	FILE       *fp;
+	char       *line = NULL, *copy;
+	size_t      linealloc = 0, index = 0;
+	ssize_t     len;
+	int         running = 0, failed = 0, status, fd;
+	pid_t       pid;
+
+	if (workers <= 0 && (workers = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+		workers = 1;
+
+	if (path) {
+		if ((fp = fopen(path, "re")) == NULL)
+			FAIL_ERRNO(101, "unable to open job-file `%s`", path);
+	} else {
+		/* jobs must not consume the job-list, they get /dev/null as stdin */
+		if ((fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3)) == -1 || (fp = fdopen(fd, "r")) == NULL)
+			FAIL_ERRNO(101, "unable to read jobs from stdin");
+		if ((fd = open("/dev/null", O_RDONLY)) != -1) {
+			dup2(fd, STDIN_FILENO);
+			if (fd != STDIN_FILENO)
+				close(fd);
+		}
+	}
+
+	if ((slots = calloc(workers, sizeof(*slots))) == NULL) {
+		FAIL_ERRNO(102, "unable to allocate memory");
+	}
+
+	for (;;) {
+		while (running < workers && (len = getline(&line, &linealloc, fp)) != -1) {
+			if (len > 0 && line[len - 1] == '\n')
+				line[--len] = '\0';
+			if (line[strspn(line, " \t")] == '\0')
+				continue;
+
+			if ((copy = strdup(line)) == NULL) {
+				FAIL_ERRNO(102, "unable to allocate memory");
+			}
+			pid = startjob(line, prefix, nprefix, useshell);
+			for (int i = 0; i < workers; i++) {
+				if (slots[i].pid == 0) {
+					slots[i] = (struct job) { ++index, pid, copy };
+					break;
+				}
+			}
+			running++;
+		}
+
+		if (running == 0)
+			break;
+
+		if ((pid = waitpid(-1, &status, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			FAIL_ERRNO(102, "unable to wait for jobs");
+		}
+		for (int i = 0; i < workers; i++) {
+			if (slots[i].pid != pid)
+				continue;
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				failed++;
+			if (ordered) {
+				report_ordered(slots[i].index, slots[i].line, status);
+			} else {
+				report(slots[i].index, slots[i].line, status);
+				free(slots[i].line);
+			}
+			slots[i].pid = 0;
+			running--;
+			break;
+		}
+	}
+
+	free(line);
+	free(slots);
+	free(pending);
+	fclose(fp);
+
+	return failed ? JOBS_FAILED : 0;
+}
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAKEFLAGS_MAX 4096
+
+
+static int  jobserver_tokens = 0; /* 0 if not serving, -1 if acquiring from MAKEFLAGS */
+static int  jobserver_pipe   = 0;
+static int  readfd = -1, writefd = -1;
+static int  passedfds[2] = { -1, -1 }, passedread = -1, passedwrite = -1; /* the pipe of make, see jobserver_init() */
+static char token;
+static int  holding;
+static char fifodir[PATH_MAX], fifopath[PATH_MAX + 8];
+
+
+static void invalid(const char *value) {
+	fprintf(stderr, "%s: invalid jobserver `%s`\n", self, value);
+	exit(100);
+}
+
+/* parse `auto` or `n[,pipe]` of -y */
+void jobserver_parse(char *spec) {
+	char *end;
+
+	if (!strcmp(spec, "auto")) {
+		jobserver_tokens = -1;
+		return;
+	}
+	jobserver_tokens = strtol(spec, &end, 10);
+	if (!strcmp(end, ",pipe"))
+		jobserver_pipe = 1;
+	else if (*end != '\0')
+		invalid(spec);
+	if (jobserver_tokens < 1)
+		invalid(spec);
+}
+
+static void jobserver_cleanup(void) {
+	if (holding && write(writefd, &token, 1) == 1)
+		holding = 0;
+	if (fifopath[0]) {
+		unlink(fifopath);
+		rmdir(fifodir);
+		fifopath[0] = '\0';
+	}
+}
+
+/* the value of --jobserver-auth (or --jobserver-fds of make before 4.2) in MAKEFLAGS, NULL if there is none */
+static const char *jobserver_auth(char *flags) {
+	const char *auth = NULL;
+
+	/* the last one wins, like in make */
+	for (char *word = strtok(flags, " "); word; word = strtok(NULL, " ")) {
+		if (!strncmp(word, "--jobserver-auth=", 17))
+			auth = word + 17;
+		else if (!strncmp(word, "--jobserver-fds=", 16))
+			auth = word + 16;
+	}
+	return auth;
+}
+
+/* duplicate the pipe of the jobserver of MAKEFLAGS before envmod opens anything itself. Once closed by make,
+ * e.g. for a command not marked with `+`, its fds would be taken by the files envmod opens. */
+void jobserver_init(void) {
+	char        flags[MAKEFLAGS_MAX];
+	const char *makeflags, *auth;
+	int         r, w;
+
+	if ((makeflags = getenv("MAKEFLAGS")) == NULL)
+		return;
+	snprintf(flags, sizeof(flags), "%s", makeflags);
+	if ((auth = jobserver_auth(flags)) == NULL || sscanf(auth, "%d,%d", &r, &w) != 2 || r < 0 || w < 0)
+		return;
+	if ((passedfds[0] = fcntl(r, F_DUPFD_CLOEXEC, FD_MIN)) == -1 ||
+	    (passedfds[1] = fcntl(w, F_DUPFD_CLOEXEC, FD_MIN)) == -1) {
+		if (passedfds[0] != -1)
+			close(passedfds[0]);
+		passedfds[0] = -1;
+		return;
+	}
+	passedread  = r;
+	passedwrite = w;
+}
+
+/* take a token of the jobserver of MAKEFLAGS, given back once envmod exits */
+static void jobserver_acquire(void) {
+	char          flags[MAKEFLAGS_MAX];
+	const char   *makeflags, *auth;
+	struct pollfd pfd = { .events = POLLIN };
+	ssize_t       n;
+
+	if ((makeflags = env_get("MAKEFLAGS")) == NULL)
+		return;
+	snprintf(flags, sizeof(flags), "%s", makeflags);
+	if ((auth = jobserver_auth(flags)) == NULL)
+		return;
+
+	if (!strncmp(auth, "fifo:", 5)) {
+		/* make itself opens the fifo read-write, so it never sees end-of-file */
+		if ((readfd = writefd = movefd(open(auth + 5, O_RDWR | O_CLOEXEC), 1)) == -1)
+			FAIL_ERRNO(101, "unable to open jobserver `%s`", auth + 5);
+	} else if (sscanf(auth, "%d,%d", &readfd, &writefd) != 2) {
+		invalid(auth);
+	} else if (passedfds[0] == -1 || readfd != passedread || writefd != passedwrite) {
+		/* make only passes its pipe to commands it considers recursive, e.g. marked with `+` */
+		if (verbose)
+			fprintf(stderr, "%s: jobserver is not passed to this command, running without a token\n", self);
+		readfd = writefd = -1;
+		return;
+	} else {
+		/* our own copies, the originals may be closed by -0 to -9 or -I */
+		readfd  = passedfds[0];
+		writefd = passedfds[1];
+	}
+
+	/* the pipe may be non-blocking as it is shared with make */
+	pfd.fd = readfd;
+	while ((n = read(readfd, &token, 1)) != 1) {
+		if (n == -1 && errno == EAGAIN)
+			poll(&pfd, 1, -1);
+		else if (n == 0 || errno != EINTR)
+			FAIL_ERRNO(101, "unable to acquire jobserver token");
+	}
+	holding = 1;
+	atexit(jobserver_cleanup);
+}
+
+/* create a jobserver with the tokens of -y n, the command holds one of them implicitly */
+static void jobserver_serve(void) {
+	char        value[MAKEFLAGS_MAX], flags[MAKEFLAGS_MAX], auth[PATH_MAX + 32];
+	const char *makeflags, *tmpdir;
+	size_t      len = 0;
+	int         pipefd[2];
+
+	if (jobserver_pipe) {
+		if (pipe(pipefd) == -1 || (readfd = movefd(pipefd[0], 0)) == -1 || (writefd = movefd(pipefd[1], 0)) == -1)
+			FAIL_ERRNO(101, "unable to create jobserver");
+		snprintf(auth, sizeof(auth), "%d,%d", readfd, writefd);
+	} else {
+		if ((tmpdir = getenv("TMPDIR")) == NULL)
+			tmpdir = "/tmp";
+		snprintf(fifodir, sizeof(fifodir), "%s/envmod-jobserver.XXXXXX", tmpdir);
+		if (mkdtemp(fifodir) == NULL)
+			FAIL_ERRNO(101, "unable to create jobserver");
+		snprintf(fifopath, sizeof(fifopath), "%s/fifo", fifodir);
+		atexit(jobserver_cleanup);
+		/* kept open read-write, so the fifo never sees end-of-file and the tokens remain */
+		if (mkfifo(fifopath, 0600) == -1 || (readfd = writefd = movefd(open(fifopath, O_RDWR | O_CLOEXEC), 1)) == -1)
+			FAIL_ERRNO(101, "unable to create jobserver");
+		snprintf(auth, sizeof(auth), "fifo:%s", fifopath);
+	}
+
+	for (int i = 1; i < jobserver_tokens; i++) {
+		if (write(writefd, "+", 1) != 1)
+			FAIL_ERRNO(101, "unable to fill jobserver");
+	}
+
+	/* replace the jobserver of an outer make */
+	if ((makeflags = env_get("MAKEFLAGS")) != NULL) {
+		snprintf(flags, sizeof(flags), "%s", makeflags);
+		for (char *word = strtok(flags, " "); word; word = strtok(NULL, " ")) {
+			if (!strncmp(word, "--jobserver-", 12) || !strncmp(word, "-j", 2))
+				continue;
+			len += snprintf(value + len, sizeof(value) - len, "%s ", word);
+			if (len >= sizeof(value))
+				invalid(makeflags);
+		}
+	}
+	len += snprintf(value + len, sizeof(value) - len, "-j%d --jobserver-auth=%s", jobserver_tokens, auth);
+	env_set("MAKEFLAGS", 9, value, len);
+}
+
+/* set up the jobserver of -y, called once the environment is complete */
+void jobserver_start(void) {
+	if (jobserver_tokens == -1)
+		jobserver_acquire();
+	else if (jobserver_tokens > 0)
+		jobserver_serve();
+}
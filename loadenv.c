@@ -0,0 +1,764 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+#include "uring.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#	include <immintrin.h>
+#	define HAVE_SIMD_SCAN 1
+#endif
+
+#define ENVCACHE_NAME  ".envmod.cache"
+#define ENVCACHE_MAGIC "ENVMODC\1"
+#define ENVCACHE_UNSET UINT32_MAX
+#define ENVCACHE_SKIP  (UINT32_MAX - 1)
+
+/* entries read per io_uring submission, small envdirs are not worth setting up a ring */
+#define ENVDIR_BATCH     64
+#define ENVDIR_URING_MIN 8
+
+
+/* the envdir-cache is a header, the entries sorted by name and a string-table */
+struct envcache_header {
+	char     magic[8];
+	uint32_t nentries;
+	uint32_t strsize;
+	uint64_t dev;
+	uint64_t ino;
+	int64_t  mtime_sec;
+	int64_t  mtime_nsec;
+};
+
+struct envcache_entry {
+	uint64_t ino;
+	int64_t  size;
+	int64_t  mtime_sec;
+	int64_t  mtime_nsec;
+	int64_t  ctime_sec;
+	int64_t  ctime_nsec;
+	uint32_t name;  /* offset in string-table */
+	uint32_t value; /* offset in string-table, ENVCACHE_UNSET or ENVCACHE_SKIP */
+};
+
+struct envent {
+	char       *name;
+	int         fd;
+	int         error; /* errno of the failed open, stat or read */
+	struct stat st;
+	char       *value;
+	size_t      size; /* bytes actually read */
+};
+
+struct envcache {
+	struct envcache_entry *entries;
+	uint32_t               nentries, entriesalloc;
+	char                  *strtab;
+	size_t                 strsize, stralloc;
+	int                    failed;
+};
+
+
+static char *strip(char *text, size_t *size) {
+	while (*size > 0 && isspace((unsigned char) text[0])) {
+		text++, (*size)--;
+	}
+	while (*size > 0 && isspace((unsigned char) text[*size - 1])) {
+		(*size)--;
+	}
+	text[*size] = '\0';
+	return text;
+}
+
+static char *nicevar(char *text, size_t size) {
+	text = strip(text, &size);
+
+	for (size_t i = 0; i < size; i++) {
+		if (text[i] == '=') {
+			fprintf(stderr, "'=' in envfile: %s\n", text);
+			return NULL;
+		}
+		if (text[i] == '\0') {
+			text[i] = '\n';
+		}
+	}
+
+	return text;
+}
+
+static void applyvar(const char *name, const char *value) {
+	if (value == NULL) {
+		env_unset(name, strlen(name));
+	} else {
+		env_set(name, strlen(name), value, strlen(value));
+	}
+}
+
+static int sametime(const struct timespec *ts, int64_t sec, int64_t nsec) {
+	return ts->tv_sec == sec && ts->tv_nsec == nsec;
+}
+
+static uint32_t envcache_addstr(struct envcache *cache, const char *str) {
+	size_t   len = strlen(str) + 1;
+	uint32_t offset;
+	char    *newtab;
+
+	if (cache->strsize + len > cache->stralloc) {
+		size_t newalloc = cache->stralloc ? cache->stralloc * 2 : 4096;
+		while (cache->strsize + len > newalloc)
+			newalloc *= 2;
+		if ((newtab = realloc(cache->strtab, newalloc)) == NULL) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		cache->strtab   = newtab;
+		cache->stralloc = newalloc;
+	}
+	offset = cache->strsize;
+	memcpy(cache->strtab + offset, str, len);
+	cache->strsize += len;
+	return offset;
+}
+
+static void envcache_add(struct envcache *cache, const char *name, const struct stat *st, const char *value,
+                         int skip) {
+	struct envcache_entry *entry, *newentries;
+
+	if (cache->nentries == cache->entriesalloc) {
+		cache->entriesalloc = cache->entriesalloc ? cache->entriesalloc * 2 : 64;
+		if ((newentries = realloc(cache->entries, cache->entriesalloc * sizeof(*entry))) == NULL) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		cache->entries = newentries;
+	}
+	entry             = &cache->entries[cache->nentries++];
+	entry->ino        = st->st_ino;
+	entry->size       = st->st_size;
+	entry->mtime_sec  = st->st_mtim.tv_sec;
+	entry->mtime_nsec = st->st_mtim.tv_nsec;
+	entry->ctime_sec  = st->st_ctim.tv_sec;
+	entry->ctime_nsec = st->st_ctim.tv_nsec;
+	entry->name       = envcache_addstr(cache, name);
+	entry->value      = skip ? ENVCACHE_SKIP : value ? envcache_addstr(cache, value) : ENVCACHE_UNSET;
+}
+
+static int envcache_compare(const void *a, const void *b, void *strtab) {
+	const struct envcache_entry *ea = a, *eb = b;
+
+	return strcmp((char *) strtab + ea->name, (char *) strtab + eb->name);
+}
+
+static const struct envcache_entry *envcache_find(const struct envcache_entry *entries, uint32_t nentries,
+                                                  const char *strtab, const char *name) {
+	uint32_t low = 0, high = nentries, mid;
+	int      cmp;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if ((cmp = strcmp(name, strtab + entries[mid].name)) == 0)
+			return &entries[mid];
+		if (cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return NULL;
+}
+
+/* check whether the envdir contains exactly the names listed in the cache */
+static int envcache_sameset(int dirfd, const struct envcache_entry *entries, uint32_t nentries, const char *strtab) {
+	DIR           *dir;
+	struct dirent *entry;
+	uint32_t       count = 0;
+	int            fd, same = 1;
+
+	if ((fd = dup(dirfd)) == -1)
+		return 0;
+	if ((dir = fdopendir(fd)) == NULL) {
+		close(fd);
+		return 0;
+	}
+	rewinddir(dir);
+
+	while (same && (entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		count++;
+		same = envcache_find(entries, nentries, strtab, entry->d_name) != NULL;
+	}
+	closedir(dir);
+
+	return same && count == nentries;
+}
+
+/* apply the cache of the envdir if it is fresh, returns 0 if it is missing or stale */
+static int envcache_load(const char *path, int dirfd, const struct stat *dirst, int *exists) {
+	struct envcache_header      *header;
+	const struct envcache_entry *entries;
+	const char                  *strtab;
+	struct stat                  st;
+	void                        *map;
+	size_t                       mapsize;
+	int                          cachefd, writable = 1, fresh = 0, touch = 0;
+
+	if ((cachefd = openat(dirfd, ENVCACHE_NAME, O_RDWR | O_CLOEXEC)) == -1 && (errno == EACCES || errno == EROFS)) {
+		cachefd  = openat(dirfd, ENVCACHE_NAME, O_RDONLY | O_CLOEXEC);
+		writable = 0;
+	}
+	if (cachefd == -1)
+		return 0;
+
+	*exists = 1;
+
+	if (fstat(cachefd, &st) == -1 || (size_t) st.st_size < sizeof(*header)) {
+		close(cachefd);
+		return 0;
+	}
+	mapsize = st.st_size;
+	if ((map = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, cachefd, 0)) == MAP_FAILED) {
+		close(cachefd);
+		return 0;
+	}
+
+	header  = map;
+	entries = (const struct envcache_entry *) (header + 1);
+	strtab  = (const char *) (entries + header->nentries);
+
+	if (memcmp(header->magic, ENVCACHE_MAGIC, sizeof(header->magic)) != 0 || header->dev != dirst->st_dev ||
+	    header->ino != dirst->st_ino ||
+	    sizeof(*header) + (uint64_t) header->nentries * sizeof(*entries) + header->strsize != mapsize ||
+	    (header->strsize > 0 && strtab[header->strsize - 1] != '\0'))
+		goto done;
+
+	for (uint32_t i = 0; i < header->nentries; i++) {
+		if (entries[i].name >= header->strsize ||
+		    (entries[i].value < ENVCACHE_SKIP && entries[i].value >= header->strsize))
+			goto done;
+	}
+
+	if (!sametime(&dirst->st_mtim, header->mtime_sec, header->mtime_nsec)) {
+		/* the directory was touched, it is still fresh if no entry was added or removed */
+		if (!envcache_sameset(dirfd, entries, header->nentries, strtab))
+			goto done;
+		touch = 1;
+	}
+
+	for (uint32_t i = 0; i < header->nentries; i++) {
+		if (fstatat(dirfd, strtab + entries[i].name, &st, 0) == -1 || (uint64_t) st.st_ino != entries[i].ino ||
+		    st.st_size != entries[i].size ||
+		    !sametime(&st.st_mtim, entries[i].mtime_sec, entries[i].mtime_nsec) ||
+		    !sametime(&st.st_ctim, entries[i].ctime_sec, entries[i].ctime_nsec))
+			goto done;
+	}
+
+	for (uint32_t i = 0; i < header->nentries; i++) {
+		if (entries[i].value == ENVCACHE_SKIP) {
+			fprintf(stderr, "'=' in envfile: %s/%s\n", path, strtab + entries[i].name);
+			continue;
+		}
+		applyvar(strtab + entries[i].name, entries[i].value == ENVCACHE_UNSET ? NULL : strtab + entries[i].value);
+	}
+	fresh = 1;
+
+	if (touch && writable) {
+		int64_t mtime[2] = { dirst->st_mtim.tv_sec, dirst->st_mtim.tv_nsec };
+		pwrite(cachefd, mtime, sizeof(mtime), offsetof(struct envcache_header, mtime_sec));
+	}
+
+done:
+	munmap(map, mapsize);
+	close(cachefd);
+	return fresh;
+}
+
+static int writeall(int fd, const void *buf, size_t size) {
+	ssize_t n;
+
+	while (size > 0) {
+		if ((n = write(fd, buf, size)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *) buf + n;
+		size -= n;
+	}
+	return 0;
+}
+
+static void envcache_write(const char *path, int dirfd, const struct stat *dirst, struct envcache *cache) {
+	struct envcache_header header;
+	char                   tmpname[sizeof(ENVCACHE_NAME) + 16];
+	int                    fd;
+
+	if (cache->failed)
+		return;
+
+	if (cache->nentries > 0)
+		qsort_r(cache->entries, cache->nentries, sizeof(*cache->entries), envcache_compare, cache->strtab);
+
+	memcpy(header.magic, ENVCACHE_MAGIC, sizeof(header.magic));
+	header.nentries   = cache->nentries;
+	header.strsize    = cache->strsize;
+	header.dev        = dirst->st_dev;
+	header.ino        = dirst->st_ino;
+	header.mtime_sec  = dirst->st_mtim.tv_sec;
+	header.mtime_nsec = dirst->st_mtim.tv_nsec;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", ENVCACHE_NAME, getpid());
+	if ((fd = openat(dirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+		if (verbose)
+			FAIL_ERRNO(-1, "unable to write envdir-cache of `%s`", path);
+		return;
+	}
+
+	if (writeall(fd, &header, sizeof(header)) == -1 ||
+	    writeall(fd, cache->entries, cache->nentries * sizeof(*cache->entries)) == -1 ||
+	    writeall(fd, cache->strtab, cache->strsize) == -1 || renameat(dirfd, tmpname, dirfd, ENVCACHE_NAME) == -1) {
+		if (verbose)
+			FAIL_ERRNO(-1, "unable to write envdir-cache of `%s`", path);
+		unlinkat(dirfd, tmpname, 0);
+	}
+	close(fd);
+}
+
+static int growbuf(char **buf, size_t *alloc, size_t size) {
+	char *newbuf;
+
+	if (size <= *alloc)
+		return 0;
+	if ((newbuf = realloc(*buf, size)) == NULL)
+		return -1;
+	*buf   = newbuf;
+	*alloc = size;
+	return 0;
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_ino          = stx->stx_ino;
+	st->st_size         = stx->stx_size;
+	st->st_mode         = stx->stx_mode;
+	st->st_mtim.tv_sec  = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec  = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* read a single entry with plain openat/fstat/read */
+static void envent_read(int dirfd, struct envent *ent, char **buf, size_t *bufalloc) {
+	ssize_t n = 0;
+	int     fd;
+
+	ent->error = 0;
+	ent->size  = 0;
+
+	if ((fd = openat(dirfd, ent->name, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &ent->st) == -1) {
+		ent->error = errno;
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	if (growbuf(buf, bufalloc, ent->st.st_size + 1) == -1) {
+		FAIL_ERRNO(102, "unable to allocate memory");
+	}
+	ent->value = *buf;
+	while (ent->size < (size_t) ent->st.st_size) {
+		if ((n = read(fd, ent->value + ent->size, ent->st.st_size - ent->size)) <= 0)
+			break;
+		ent->size += n;
+	}
+	if (n == -1)
+		ent->error = errno;
+	close(fd);
+}
+
+/* read a batch of entries using three io_uring submissions: open, statx and read+close. Every submission is
+ * reaped completely before the next, if the ring is too small for one the batch is read without io_uring. */
+static int envdir_read_uring(struct uring *ring, int dirfd, struct envent *ents, int nents, char **buf,
+                             size_t *bufalloc) {
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct statx         stx[ENVDIR_BATCH];
+	size_t               total = 0;
+	unsigned             nsqe;
+	int                  j;
+
+	for (j = 0; j < nents; j++) {
+		ents[j].fd    = -1;
+		ents[j].error = 0;
+		ents[j].size  = 0;
+	}
+	for (j = 0; j < nents; j++) {
+		if ((sqe = uring_sqe(ring)) == NULL)
+			goto fail;
+		sqe->opcode      = IORING_OP_OPENAT;
+		sqe->fd          = dirfd;
+		sqe->addr        = (uintptr_t) ents[j].name;
+		sqe->open_flags  = O_RDONLY | O_CLOEXEC;
+		sqe->user_data   = j;
+	}
+	if (uring_submit(ring, nents) == -1)
+		goto fail;
+	while ((cqe = uring_cqe(ring)) != NULL) {
+		if (cqe->res < 0)
+			ents[cqe->user_data].error = -cqe->res;
+		else
+			ents[cqe->user_data].fd = cqe->res;
+		uring_cqe_seen(ring);
+	}
+
+	nsqe = 0;
+	for (j = 0; j < nents; j++) {
+		if (ents[j].fd == -1)
+			continue;
+		if ((sqe = uring_sqe(ring)) == NULL)
+			goto fail;
+		sqe->opcode      = IORING_OP_STATX;
+		sqe->fd          = ents[j].fd;
+		sqe->addr        = (uintptr_t) "";
+		sqe->len         = STATX_BASIC_STATS;
+		sqe->statx_flags = AT_EMPTY_PATH;
+		sqe->off         = (uintptr_t) &stx[j];
+		sqe->user_data   = j;
+		nsqe++;
+	}
+	if (nsqe > 0 && uring_submit(ring, nsqe) == -1)
+		goto fail;
+	while ((cqe = uring_cqe(ring)) != NULL) {
+		j = cqe->user_data;
+		if (cqe->res < 0) {
+			if (fstat(ents[j].fd, &ents[j].st) == -1)
+				ents[j].error = errno;
+		} else {
+			statx_to_stat(&stx[j], &ents[j].st);
+		}
+		uring_cqe_seen(ring);
+	}
+
+	for (j = 0; j < nents; j++) {
+		if (ents[j].fd != -1 && !ents[j].error)
+			total += ents[j].st.st_size + 1;
+	}
+	if (growbuf(buf, bufalloc, total) == -1) {
+		FAIL_ERRNO(102, "unable to allocate memory");
+	}
+
+	nsqe  = 0;
+	total = 0;
+	for (j = 0; j < nents; j++) {
+		if (ents[j].fd == -1)
+			continue;
+		if (!ents[j].error && ents[j].st.st_size > 0) {
+			ents[j].value = *buf + total;
+			if ((sqe = uring_sqe(ring)) == NULL)
+				goto fail;
+			sqe->opcode    = IORING_OP_READ;
+			sqe->fd        = ents[j].fd;
+			sqe->addr      = (uintptr_t) ents[j].value;
+			sqe->len       = ents[j].st.st_size;
+			sqe->flags     = IOSQE_IO_HARDLINK;
+			sqe->user_data = j * 2;
+			total += ents[j].st.st_size + 1;
+			nsqe++;
+		}
+		if ((sqe = uring_sqe(ring)) == NULL)
+			goto fail;
+		sqe->opcode    = IORING_OP_CLOSE;
+		sqe->fd        = ents[j].fd;
+		sqe->user_data = j * 2 + 1;
+		nsqe++;
+	}
+	if (nsqe > 0 && uring_submit(ring, nsqe) == -1)
+		goto fail;
+	while ((cqe = uring_cqe(ring)) != NULL) {
+		j = cqe->user_data / 2;
+		if (cqe->user_data % 2 == 0) {
+			if (cqe->res < 0)
+				ents[j].error = -cqe->res;
+			else
+				ents[j].size = cqe->res;
+		} else {
+			ents[j].fd = -1;
+		}
+		uring_cqe_seen(ring);
+	}
+
+	return 0;
+
+fail:
+	for (j = 0; j < nents; j++) {
+		if (ents[j].fd != -1)
+			close(ents[j].fd);
+	}
+	return -1;
+}
+
+static void envdir_apply(const char *path, struct envent *ent, struct envcache *cache) {
+	char *value;
+
+	if (ent->error) {
+		errno = ent->error;
+		FAIL_ERRNO(-1, "unable to read `%s/%s`", path, ent->name);
+		if (cache)
+			cache->failed = 1;
+		profile_fail();
+		return;
+	}
+	if (ent->st.st_size == 0) {
+		applyvar(ent->name, NULL);
+		if (cache)
+			envcache_add(cache, ent->name, &ent->st, NULL, 0);
+	} else if ((value = nicevar(ent->value, ent->size)) != NULL) {
+		applyvar(ent->name, value);
+		if (cache)
+			envcache_add(cache, ent->name, &ent->st, value, 0);
+	} else if (cache) {
+		envcache_add(cache, ent->name, &ent->st, NULL, 1);
+	}
+}
+
+static void load_envdir(const char *path, int dirfd, struct envcache *cache) {
+	DIR           *dir;
+	struct dirent *entry;
+	struct envent *ents = NULL, *newents;
+	struct uring   ring = { .fd = -1 };
+	char          *names = NULL, *batchbuf = NULL, *entbuf = NULL;
+	size_t         namesalloc = 0, namessize = 0, batchalloc = 0, entalloc = 0, len;
+	int            nents = 0, entsalloc = 0, useuring = 0, fd, k;
+
+	static const int uringops[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE };
+
+	if ((fd = dup(dirfd)) == -1 || (dir = fdopendir(fd)) == NULL) {
+		FAIL_ERRNO(101, "unable to open envdir `%s`", path);
+	}
+	rewinddir(dir);
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		if (nents == entsalloc) {
+			entsalloc = entsalloc ? entsalloc * 2 : 64;
+			if ((newents = realloc(ents, entsalloc * sizeof(*ents))) == NULL) {
+				FAIL_ERRNO(102, "unable to allocate memory");
+			}
+			ents = newents;
+		}
+		len = strlen(entry->d_name) + 1;
+		if (namessize + len > namesalloc && growbuf(&names, &namesalloc, (namessize + len) * 2) == -1) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		memcpy(names + namessize, entry->d_name, len);
+		/* names may move while growing, store the offset for now */
+		ents[nents++].name = (char *) namessize;
+		namessize += len;
+	}
+	closedir(dir);
+
+	for (int i = 0; i < nents; i++)
+		ents[i].name = names + (size_t) ents[i].name;
+
+	if (nents >= ENVDIR_URING_MIN && uring_init(&ring, ENVDIR_BATCH * 2) == 0)
+		useuring = uring_supported(&ring, uringops, sizeof(uringops) / sizeof(*uringops));
+
+	for (int i = 0; i < nents; i += ENVDIR_BATCH) {
+		k = nents - i < ENVDIR_BATCH ? nents - i : ENVDIR_BATCH;
+
+		if (useuring && envdir_read_uring(&ring, dirfd, ents + i, k, &batchbuf, &batchalloc) == -1) {
+			useuring = 0;
+		}
+		for (int j = i; j < i + k; j++) {
+			/* the batch may hit the fd-limit, retry these one by one */
+			if (!useuring || ents[j].error == EMFILE || ents[j].error == ENFILE)
+				envent_read(dirfd, &ents[j], &entbuf, &entalloc);
+			envdir_apply(path, &ents[j], cache);
+		}
+	}
+
+	uring_free(&ring);
+	free(batchbuf);
+	free(entbuf);
+	free(names);
+	free(ents);
+}
+
+void parse_envdir(const char *path, int buildcache) {
+	struct envcache cache = { 0 };
+	struct stat     dirst;
+	int             dirfd, exists = 0;
+
+	if ((dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 || fstat(dirfd, &dirst) == -1) {
+		FAIL_ERRNO(101, "unable to open envdir `%s`", path);
+	}
+
+	if (envcache_load(path, dirfd, &dirst, &exists)) {
+		close(dirfd);
+		return;
+	}
+
+	if (!exists && !buildcache) {
+		load_envdir(path, dirfd, NULL);
+		close(dirfd);
+		return;
+	}
+
+	if (verbose && exists)
+		fprintf(stderr, "%s: envdir-cache of `%s` is stale, rebuilding\n", self, path);
+
+	load_envdir(path, dirfd, &cache);
+	envcache_write(path, dirfd, &dirst, &cache);
+
+	free(cache.entries);
+	free(cache.strtab);
+	close(dirfd);
+}
+
+/* scan the line starting at p, return its end and store the first '=' in *eq (NULL if none) */
+typedef const char *(*scanline_t)(const char *p, const char *end, const char **eq);
+
+static const char *scanline_tail(const char *p, const char *end, const char **eq) {
+	for (; p < end && *p != '\n'; p++) {
+		if (*p == '=' && *eq == NULL)
+			*eq = p;
+	}
+	return p;
+}
+
+static const char *scanline_scalar(const char *p, const char *end, const char **eq) {
+	*eq = NULL;
+	return scanline_tail(p, end, eq);
+}
+
+#ifdef HAVE_SIMD_SCAN
+__attribute__((target("sse2"))) static const char *scanline_sse2(const char *p, const char *end, const char **eq) {
+	const __m128i newline = _mm_set1_epi8('\n'), equal = _mm_set1_epi8('=');
+	__m128i       chunk;
+	unsigned      nlmask, eqmask;
+
+	*eq = NULL;
+	for (; end - p >= 16; p += 16) {
+		chunk  = _mm_loadu_si128((const __m128i *) p);
+		nlmask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+		eqmask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, equal));
+		if (nlmask)
+			eqmask &= (1u << __builtin_ctz(nlmask)) - 1;
+		if (eqmask && *eq == NULL)
+			*eq = p + __builtin_ctz(eqmask);
+		if (nlmask)
+			return p + __builtin_ctz(nlmask);
+	}
+	return scanline_tail(p, end, eq);
+}
+
+__attribute__((target("avx2"))) static const char *scanline_avx2(const char *p, const char *end, const char **eq) {
+	const __m256i newline = _mm256_set1_epi8('\n'), equal = _mm256_set1_epi8('=');
+	__m256i       chunk;
+	unsigned      nlmask, eqmask;
+
+	*eq = NULL;
+	for (; end - p >= 32; p += 32) {
+		chunk  = _mm256_loadu_si256((const __m256i *) p);
+		nlmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+		eqmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, equal));
+		if (nlmask)
+			eqmask &= (1u << __builtin_ctz(nlmask)) - 1;
+		if (eqmask && *eq == NULL)
+			*eq = p + __builtin_ctz(eqmask);
+		if (nlmask)
+			return p + __builtin_ctz(nlmask);
+	}
+	return scanline_tail(p, end, eq);
+}
+#endif
+
+static scanline_t scanline_select(void) {
+#ifdef HAVE_SIMD_SCAN
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return scanline_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return scanline_sse2;
+#endif
+	return scanline_scalar;
+}
+
+/* read a file which cannot be mapped, like a pipe */
+static char *readall(int fd, size_t *size) {
+	char   *buf = NULL;
+	size_t  alloc = 0;
+	ssize_t n;
+
+	*size = 0;
+	do {
+		if (*size == alloc && growbuf(&buf, &alloc, alloc ? alloc * 2 : 4096) == -1) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		if ((n = read(fd, buf + *size, alloc - *size)) == -1 && errno != EINTR) {
+			free(buf);
+			return NULL;
+		}
+		if (n > 0)
+			*size += n;
+	} while (n != 0);
+
+	return buf;
+}
+
+void parse_envfile(const char *path) {
+	static scanline_t scanline;
+	struct stat       st;
+	const char       *buf, *end, *line, *next, *key, *eq, *value, *valueend;
+	char             *data = NULL;
+	void             *map  = MAP_FAILED;
+	size_t            size = 0;
+	int               fd;
+
+	if (scanline == NULL)
+		scanline = scanline_select();
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st) == -1) {
+		FAIL_ERRNO(101, "unable to open envfile `%s`", path);
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		size = st.st_size;
+		if (size > 0 && (map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
+			madvise(map, size, MADV_SEQUENTIAL);
+	}
+	if (map != MAP_FAILED) {
+		buf = map;
+	} else if (S_ISREG(st.st_mode) && size == 0) {
+		buf = "";
+	} else if ((buf = data = readall(fd, &size)) == NULL) {
+		FAIL_ERRNO(101, "unable to read envfile `%s`", path);
+	}
+	close(fd);
+
+	for (line = buf, end = buf + size; line < end; line = next + 1) {
+		next = scanline(line, end, &eq);
+		if (eq == NULL)
+			continue;
+
+		for (key = line; key < eq && isspace((unsigned char) *key); key++)
+			;
+		for (value = eq + 1, valueend = next; valueend > value && isspace((unsigned char) valueend[-1]); valueend--)
+			;
+
+		if (valueend == value) {
+			env_unset(key, eq - key);
+		} else {
+			env_set(key, eq - key, value, valueend - value);
+		}
+	}
+
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	free(data);
+}
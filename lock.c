@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOCK_TIMEDOUT 103
+
+
+static int lock_slotindex = -1; /* the slot taken of a semaphore */
+
+
+static long long elapsed(const struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* block in flock(2) on every fd in a helper each, the locks belong to the shared open file descriptions
+ * and thus to us. The first helper to get its lock writes its index to a pipe, the rest are killed,
+ * so neither alarm(2) nor a signal-handler is involved. Returns the index of the locked fd, a timeout
+ * of 0 waits forever. */
+static int lock_any(const int *fds, int nfds, int flags, long timeout, const struct timespec *start) {
+	struct pollfd   pfd = { .events = POLLIN };
+	struct timespec remaining;
+	long long       left;
+	int             pipefd[2], status, ret, locked = -1, err = ETIMEDOUT;
+	pid_t          *pids;
+
+	if ((pids = calloc(nfds, sizeof(*pids))) == NULL || pipe2(pipefd, O_CLOEXEC) == -1) {
+		free(pids);
+		return -1;
+	}
+
+	for (int i = 0; i < nfds; i++) {
+		if ((pids[i] = fork()) == -1) {
+			err = errno;
+			break;
+		}
+		if (pids[i] == 0) {
+			close(pipefd[0]);
+			if (flock(fds[i], flags & ~LOCK_NB) == -1)
+				_exit(errno);
+			_exit(write(pipefd[1], &i, sizeof(i)) == sizeof(i) ? 0 : errno);
+		}
+	}
+	close(pipefd[1]);
+
+	/* the pipe hangs up once every helper exited without a lock */
+	pfd.fd = pipefd[0];
+	do {
+		if ((left = timeout - elapsed(start)) < 0)
+			left = 0;
+		remaining = (struct timespec) { left / 1000000, left % 1000000 * 1000 };
+	} while ((ret = ppoll(&pfd, 1, timeout ? &remaining : NULL, NULL)) == -1 && errno == EINTR);
+
+	if (ret > 0 && read(pipefd[0], &locked, sizeof(locked)) != sizeof(locked))
+		locked = -1;
+
+	for (int i = 0; i < nfds && pids[i] > 0; i++)
+		kill(pids[i], SIGKILL);
+	for (int i = 0; i < nfds && pids[i] > 0; i++) {
+		while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR)
+			;
+		if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+			err = WEXITSTATUS(status);
+	}
+	close(pipefd[0]);
+	free(pids);
+
+	/* the other helpers may have got their lock right before they were killed */
+	for (int i = 0; i < nfds; i++) {
+		if (i == locked)
+			continue;
+		if (locked == -1 && flock(fds[i], flags | LOCK_NB) == 0)
+			locked = i;
+		else
+			flock(fds[i], LOCK_UN);
+	}
+
+	if (locked == -1)
+		errno = err;
+	return locked;
+}
+
+static void lock_failed(const struct timespec *start) {
+	if (errno == ETIMEDOUT) {
+		fprintf(stderr, "%s: timed out waiting for lock after %lld us\n", self, elapsed(start));
+		exit(LOCK_TIMEDOUT);
+	}
+	FAIL_ERRNO(101, "unable to lock file");
+}
+
+/* lock fd, waiting at most timeout microseconds if timeout is not 0 */
+static void lock_one(int fd, int flags, long timeout, const struct timespec *start) {
+	if (flock(fd, timeout ? flags | LOCK_NB : flags) == -1) {
+		if (!timeout || errno != EWOULDBLOCK || lock_any(&fd, 1, flags, timeout, start) == -1)
+			lock_failed(start);
+	}
+}
+
+/* take one of the slots `path.0` to `path.<n-1>`, probing every slot before waiting.
+ * Waiters queue up on path itself, only the first one waits for any slot to become free. */
+static int lock_slot(const char *path, int slots, int flags, int fdflags, long timeout, const struct timespec *start) {
+	char slotpath[PATH_MAX];
+	int *fds, queue, locked = -1, fd;
+
+	if ((fds = calloc(slots, sizeof(*fds))) == NULL)
+		FAIL_ERRNO(102, "unable to allocate memory");
+	for (int i = 0; i < slots; i++) {
+		snprintf(slotpath, sizeof(slotpath), "%s.%d", path, i);
+		if ((fds[i] = open(slotpath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1)
+			FAIL_ERRNO(101, "unable to open lockfile");
+	}
+
+	for (int i = 0; i < slots && locked == -1; i++) {
+		if (flock(fds[i], LOCK_EX | LOCK_NB) == 0)
+			locked = i;
+		else if (errno != EWOULDBLOCK)
+			lock_failed(start);
+	}
+
+	if (locked == -1) {
+		/* like lock_one(), a non-blocking lock still waits for the timeout if there is one */
+		if ((flags & LOCK_NB) && !timeout) {
+			errno = EWOULDBLOCK;
+			lock_failed(start);
+		}
+		if ((queue = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1)
+			FAIL_ERRNO(101, "unable to open lockfile");
+		lock_one(queue, LOCK_EX, timeout, start);
+		if ((locked = lock_any(fds, slots, LOCK_EX, timeout, start)) == -1)
+			lock_failed(start);
+		close(queue);
+	}
+
+	for (int i = 0; i < slots; i++) {
+		if (i != locked)
+			close(fds[i]);
+	}
+	fd = fds[locked];
+	free(fds);
+
+	/* like the lock of -l, the slot is inherited by the command unless asked otherwise */
+	if (!(fdflags & O_CLOEXEC) && fcntl(fd, F_SETFD, 0) == -1)
+		FAIL_ERRNO(101, "unable to pass lock");
+
+	lock_slotindex = locked;
+	return fd;
+}
+
+/* open and lock path, waiting at most timeout microseconds if timeout is not 0.
+ * With slots, path is a semaphore of which one slot is taken. */
+int lockfile(const char *path, int flags, int fdflags, long timeout, int slots) {
+	struct timespec start;
+	int             fd, mode;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (slots > 0) {
+		fd = lock_slot(path, slots, flags, fdflags, timeout, &start);
+		if (verbose)
+			fprintf(stderr, "%s: acquired slot %d of %d after %lld us\n", self, lock_slotindex, slots,
+			        elapsed(&start));
+		return fd;
+	}
+
+	/* a shared lock does not require write-access */
+	mode = (flags & LOCK_SH) ? O_RDONLY : O_WRONLY | O_APPEND;
+	if ((fd = open(path, fdflags | mode | O_CREAT, 0644)) == -1)
+		FAIL_ERRNO(101, "unable to open lockfile");
+
+	lock_one(fd, flags, timeout, &start);
+
+	if (verbose)
+		fprintf(stderr, "%s: acquired %s lock after %lld us\n", self, (flags & LOCK_SH) ? "shared" : "exclusive",
+		        elapsed(&start));
+
+	return fd;
+}
+
+/* tell the command which slot it holds */
+void lock_env(void) {
+	char value[12];
+	int  len;
+
+	if (lock_slotindex == -1)
+		return;
+	len = snprintf(value, sizeof(value), "%d", lock_slotindex);
+	env_set("ENVMOD_SLOT", 11, value, len);
+}
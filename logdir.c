@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_PIPESIZE 1048576 /* the backlog the child may write without being drained */
+#define LOG_SIZE     1000000 /* default size to rotate current at */
+#define LOG_KEEP     10      /* default number of rotated files */
+#define LOG_BUFSIZE  65536   /* chunk read with timestamps */
+#define LOG_SLOW     0.05    /* seconds a write may take before the disk is considered too slow */
+
+
+static char *const logopts[] = { "size", "age", "keep", "timestamp", NULL };
+
+static const char   *logpath;
+static long long     log_size = LOG_SIZE, written, lost;
+static long          log_age;
+static int           log_keep = LOG_KEEP, log_timestamp;
+static int           logdirfd = -1, currentfd = -1, nullfd = -1, pipesize;
+static int           linestart = 1, slow;
+static struct source pipesrc, agesrc;
+
+
+static void invalid(const char *value) {
+	fprintf(stderr, "%s: invalid log option `%s`\n", self, value ? value : "");
+	exit(100);
+}
+
+static long long number(const char *value) {
+	char     *end;
+	long long num;
+
+	if (!value || (num = strtoll(value, &end, 10)) < 0 || end == value || *end)
+		invalid(value);
+	return num;
+}
+
+/* parse `dir[,size=bytes][,age=seconds][,keep=n][,timestamp]` of -O */
+void logdir_parse(char *spec) {
+	char *value;
+
+	logpath = spec;
+	if ((spec = strchr(spec, ',')) != NULL)
+		*spec++ = '\0';
+
+	while (spec && *spec) {
+		switch (getsubopt(&spec, logopts, &value)) {
+			case 0:
+				if ((log_size = number(value)) == 0)
+					invalid(value);
+				break;
+			case 1:
+				log_age = number(value);
+				break;
+			case 2:
+				log_keep = number(value);
+				break;
+			case 3:
+				log_timestamp = 1;
+				break;
+			default:
+				invalid(value);
+		}
+	}
+	if (!*logpath)
+		invalid(logpath);
+}
+
+static void opencurrent(void) {
+	/* splice() refuses O_APPEND, we are the only writer anyway */
+	if ((currentfd = movefd(openat(logdirfd, "current", O_WRONLY | O_CREAT | O_CLOEXEC, 0644), 1)) == -1) {
+		FAIL_ERRNO(-1, "unable to open log `%s/current`", logpath);
+		return;
+	}
+	if ((written = lseek(currentfd, 0, SEEK_END)) == -1)
+		written = 0;
+}
+
+static int compare(const struct dirent **a, const struct dirent **b) {
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int isrotated(const struct dirent *ent) {
+	return ent->d_name[0] == '@';
+}
+
+/* rename current to @seconds.micros.s and remove all but the newest log_keep of those */
+static void rotate(void) {
+	struct dirent **ents;
+	struct timespec now;
+	char            name[48];
+	int             n;
+
+	if (currentfd != -1 && written == 0)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	snprintf(name, sizeof(name), "@%lld.%06ld.s", (long long) now.tv_sec, now.tv_nsec / 1000);
+	if (renameat(logdirfd, "current", logdirfd, name) == -1)
+		FAIL_ERRNO(-1, "unable to rotate log `%s/current`", logpath);
+	if (currentfd != -1)
+		close(currentfd);
+	opencurrent();
+
+	if ((n = scandirat(logdirfd, ".", &ents, isrotated, compare)) == -1)
+		return;
+	for (int i = 0; i < n; i++) {
+		if (i < n - log_keep && unlinkat(logdirfd, ents[i]->d_name, 0) == -1)
+			FAIL_ERRNO(-1, "unable to remove log `%s/%s`", logpath, ents[i]->d_name);
+		free(ents[i]);
+	}
+	free(ents);
+}
+
+/* restart the age of current */
+static void agetimer(void) {
+	if (log_age > 0)
+		settimer(agesrc.fd, log_age);
+}
+
+/* create the log directory and the pipe of -O, before changing user or root directory */
+void logdir_open(void) {
+	int pipefd[2];
+
+	if (!logpath)
+		return;
+
+	if (mkdir(logpath, 0755) == -1 && errno != EEXIST)
+		FAIL_ERRNO(101, "unable to create log `%s`", logpath);
+	if ((logdirfd = movefd(open(logpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC), 1)) == -1)
+		FAIL_ERRNO(101, "unable to open log `%s`", logpath);
+	opencurrent();
+	if (currentfd == -1)
+		exit(101);
+	if ((nullfd = movefd(open("/dev/null", O_WRONLY | O_CLOEXEC), 1)) == -1)
+		FAIL_ERRNO(101, "unable to open `/dev/null`");
+
+	/* the child blocks once the pipe is full, a large pipe leaves time to catch up */
+	if (pipe2(pipefd, O_CLOEXEC) == -1 || (pipesrc.fd = movefd(pipefd[0], 1)) == -1 ||
+	    (spawn_logfd = movefd(pipefd[1], 1)) == -1)
+		FAIL_ERRNO(101, "unable to create log pipe");
+	fcntl(pipesrc.fd, F_SETFL, O_NONBLOCK);
+	if ((pipesize = fcntl(pipesrc.fd, F_SETPIPE_SZ, LOG_PIPESIZE)) == -1)
+		pipesize = fcntl(pipesrc.fd, F_GETPIPE_SZ);
+}
+
+/* write the pending data with a timestamp in front of every line, this passes through user space */
+static ssize_t writestamped(void) {
+	char            buf[LOG_BUFSIZE], out[LOG_BUFSIZE], stamp[32];
+	struct timespec now;
+	struct tm       tm;
+	ssize_t         n, len = 0, stamplen, total = 0;
+
+	if ((n = read(pipesrc.fd, buf, sizeof(buf))) <= 0)
+		return n;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	gmtime_r(&now.tv_sec, &tm);
+	stamplen = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+	stamplen += snprintf(stamp + stamplen, sizeof(stamp) - stamplen, ".%06ldZ ", now.tv_nsec / 1000);
+
+	for (ssize_t i = 0; i <= n; i++) {
+		if (i == n || len + stamplen + 1 > (ssize_t) sizeof(out)) {
+			if (write(currentfd, out, len) != len)
+				return -1;
+			total += len;
+			len = 0;
+		}
+		if (i == n)
+			break;
+		if (linestart) {
+			memcpy(out + len, stamp, stamplen);
+			len += stamplen;
+		}
+		out[len++] = buf[i];
+		linestart  = buf[i] == '\n';
+	}
+	return total;
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* move what the child wrote into current, without blocking the child if we fall behind. SPLICE_F_NONBLOCK only
+ * applies to the pipe, the write to current still blocks the event-loop of the supervisor while the disk stalls. */
+static void drain(void) {
+	char    notice[64];
+	int     pending, len;
+	ssize_t n;
+	double  start;
+
+	while (ioctl(pipesrc.fd, FIONREAD, &pending) == 0 && pending > 0) {
+		/* the child is about to block on a full pipe as the disk is too slow: drop the backlog */
+		if ((slow && pending >= pipesize - pipesize / 8) || currentfd == -1) {
+			if ((n = splice(pipesrc.fd, NULL, nullfd, NULL, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) <= 0)
+				return;
+			lost += n;
+			if (currentfd != -1) {
+				len = snprintf(notice, sizeof(notice), "%s: log lost %zd bytes\n", self, n);
+				if (write(currentfd, notice, len) == len)
+					written += len;
+			}
+			continue;
+		}
+
+		start = now();
+		if (log_timestamp)
+			n = writestamped();
+		else
+			n = splice(pipesrc.fd, NULL, currentfd, NULL, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		slow = now() - start > LOG_SLOW;
+		if (n == -1 && errno != EAGAIN) {
+			/* drop everything until the next rotation opens current again */
+			FAIL_ERRNO(-1, "unable to write log `%s/current`", logpath);
+			close(currentfd);
+			currentfd = -1;
+			continue;
+		}
+		if (n <= 0)
+			return;
+
+		/* rotated between writes of the child, a line is only split if the child wrote it in parts */
+		if ((written += n) >= log_size) {
+			rotate();
+			agetimer();
+		}
+	}
+}
+
+static void handle_pipe(struct source *src) {
+	(void) src;
+	drain();
+}
+
+static void handle_age(struct source *src) {
+	uint64_t expirations;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) <= 0)
+		return;
+	rotate();
+	agetimer();
+}
+
+/* watch the pipe of the child from the event-loop of the supervisor */
+void logdir_start(void) {
+	if (!logpath)
+		return;
+
+	pipesrc.handle = handle_pipe;
+	supervise_watch(&pipesrc, EPOLLIN);
+
+	if (log_age > 0) {
+		if ((agesrc.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+			FAIL_ERRNO(102, "unable to create timerfd");
+		agesrc.handle = handle_age;
+		supervise_watch(&agesrc, EPOLLIN);
+		agetimer();
+	}
+}
+
+/* write what is left once the child exited, descendants may still hold the pipe */
+void logdir_flush(void) {
+	if (!logpath)
+		return;
+
+	drain();
+	if (log_timestamp && !linestart && write(currentfd, "\n", 1) == 1)
+		written++;
+	if (lost > 0)
+		fprintf(stderr, "%s: log lost %lld bytes\n", self, lost);
+}
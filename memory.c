@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+#ifndef PR_SET_MEMORY_MERGE
+#	define PR_SET_MEMORY_MERGE 67
+#endif
+#ifndef PR_THP_DISABLE_EXCEPT_ADVISED
+#	define PR_THP_DISABLE_EXCEPT_ADVISED (1 << 1)
+#endif
+
+
+enum {
+	OPT_THP,
+	OPT_KSM,
+	OPT_OOM,
+};
+
+static char *const memopts[] = {
+	[OPT_THP] = "thp",
+	[OPT_KSM] = "ksm",
+	[OPT_OOM] = "oom",
+	NULL,
+};
+
+
+static void invalid(const char *what, const char *value) {
+	fprintf(stderr, "%s: invalid memory %s `%s`\n", self, what, value ? value : "");
+	exit(100);
+}
+
+static void set_oomscore(const char *value) {
+	char   *end;
+	long    score;
+	int     fd;
+	ssize_t len = strlen(value);
+
+	score = strtol(value, &end, 10);
+	if (!*value || *end || score < -1000 || score > 1000)
+		invalid("oom-score", value);
+
+	if ((fd = open("/proc/self/oom_score_adj", O_WRONLY | O_CLOEXEC)) == -1)
+		FAIL_ERRNO(101, "unable to open oom_score_adj");
+	if (write(fd, value, len) != len)
+		FAIL_ERRNO(101, "unable to set oom-score");
+	close(fd);
+}
+
+/* apply the memory-settings of spec, which are inherited across exec:
+ * `thp=never|advise|inherit`, `ksm` and `oom=score` separated by commas */
+void set_memory(char *spec) {
+	char *value;
+
+	while (*spec) {
+		switch (getsubopt(&spec, memopts, &value)) {
+			case OPT_THP:
+				if (value && !strcmp(value, "never")) {
+					if (prctl(PR_SET_THP_DISABLE, 1, 0, 0, 0) == -1)
+						FAIL_ERRNO(101, "unable to disable transparent hugepages");
+				} else if (value && !strcmp(value, "advise")) {
+					if (prctl(PR_SET_THP_DISABLE, 1, PR_THP_DISABLE_EXCEPT_ADVISED, 0, 0) == -1)
+						FAIL_ERRNO(101, "unable to restrict transparent hugepages");
+				} else if (value && !strcmp(value, "inherit")) {
+					/* undo a disable inherited from our parent, the system-setting applies again */
+					if (prctl(PR_SET_THP_DISABLE, 0, 0, 0, 0) == -1)
+						FAIL_ERRNO(101, "unable to enable transparent hugepages");
+				} else {
+					invalid("thp-mode", value);
+				}
+				break;
+			case OPT_KSM:
+				if (value)
+					invalid("option", value);
+				if (prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0) == -1)
+					FAIL_ERRNO(101, "unable to enable memory merging");
+				break;
+			case OPT_OOM:
+				if (!value)
+					invalid("oom-score", value);
+				set_oomscore(value);
+				break;
+			default:
+				invalid("option", value);
+		}
+	}
+}
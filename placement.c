@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NODEMASK_BITS 1024
+#define LONG_BITS     (8 * sizeof(unsigned long))
+
+
+static const struct {
+	const char *name;
+	int         mode;
+	int         nodes; /* whether nodes are required */
+} mempolicies[] = {
+	{ "default", MPOL_DEFAULT, 0 },
+	{ "local", MPOL_LOCAL, 0 },
+	{ "preferred", MPOL_PREFERRED, 1 },
+	{ "bind", MPOL_BIND, 1 },
+	{ "interleave", MPOL_INTERLEAVE, 1 },
+};
+
+/* devices of which the NUMA node can be looked up, tried in order */
+static const char *devpaths[] = {
+	"/sys/class/net/%s",
+	"/sys/class/block/%s",
+	"/sys/bus/pci/devices/%s",
+};
+
+
+static int readfile(const char *path, char *buf, size_t size) {
+	ssize_t n;
+	int     fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+	buf[n] = '\0';
+	return 0;
+}
+
+/* parse a list like `0-3,8,10-11` into the bitmask of nbits bits */
+static int parse_list(const char *str, unsigned long *mask, int nbits) {
+	char *end;
+	long  from, to;
+
+	memset(mask, 0, (nbits + LONG_BITS - 1) / LONG_BITS * sizeof(*mask));
+	while (*str && *str != '\n') {
+		from = to = strtol(str, &end, 10);
+		if (end == str)
+			return -1;
+		if (*end == '-') {
+			str = end + 1;
+			to  = strtol(str, &end, 10);
+			if (end == str)
+				return -1;
+		}
+		if (from < 0 || to >= nbits || from > to)
+			return -1;
+		for (long i = from; i <= to; i++)
+			mask[i / LONG_BITS] |= 1UL << (i % LONG_BITS);
+		if (*end == ',')
+			end++;
+		else if (*end && *end != '\n')
+			return -1;
+		str = end;
+	}
+	return 0;
+}
+
+static int isset(const unsigned long *mask, int bit) {
+	return (mask[bit / LONG_BITS] >> (bit % LONG_BITS)) & 1;
+}
+
+/* NUMA node of a network-device, block-device, PCI-address or sysfs-directory, -1 if unknown.
+ * Devices like virtio have no node themselves, so their parents are searched up to the bus. */
+static int device_node(const char *dev) {
+	char path[PATH_MAX], real[PATH_MAX], buf[32], *sep;
+
+	real[0] = '\0';
+	if (dev[0] == '/') {
+		realpath(dev, real);
+	} else {
+		for (size_t i = 0; i < sizeof(devpaths) / sizeof(*devpaths) && !real[0]; i++) {
+			snprintf(path, sizeof(path), devpaths[i], dev);
+			if (!realpath(path, real))
+				real[0] = '\0';
+		}
+	}
+	if (!real[0]) {
+		fprintf(stderr, "%s: unknown device `%s`\n", self, dev);
+		exit(100);
+	}
+
+	while (strncmp(real, "/sys/devices/", 13) == 0) {
+		snprintf(path, sizeof(path), "%s/numa_node", real);
+		if (readfile(path, buf, sizeof(buf)) == 0)
+			return atoi(buf);
+		if ((sep = strrchr(real, '/')) == NULL)
+			break;
+		*sep = '\0';
+	}
+	return -1;
+}
+
+/* pick ncpus of the node, one thread of every core first, then their SMT siblings */
+static void node_cpus(int node, int ncpus, cpu_set_t *set) {
+	unsigned long cpus[CPU_SETSIZE / LONG_BITS], siblings[CPU_SETSIZE / LONG_BITS];
+	char          path[128], buf[4096];
+	int           picked = 0, leader;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	/* without NUMA-support every CPU is local */
+	if ((node < 0 || readfile(path, buf, sizeof(buf)) == -1) &&
+	    readfile("/sys/devices/system/cpu/online", buf, sizeof(buf)) == -1)
+		FAIL_ERRNO(101, "unable to read CPU topology");
+	if (parse_list(buf, cpus, CPU_SETSIZE) == -1) {
+		fprintf(stderr, "%s: invalid CPU topology\n", self);
+		exit(101);
+	}
+
+	CPU_ZERO(set);
+	for (int pass = 0; pass < 2; pass++) {
+		for (int cpu = 0; cpu < CPU_SETSIZE && (ncpus == 0 || picked < ncpus); cpu++) {
+			if (!isset(cpus, cpu) || CPU_ISSET(cpu, set))
+				continue;
+			if (pass == 0) {
+				/* the lowest thread of a core leads it */
+				snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+				leader = cpu;
+				if (readfile(path, buf, sizeof(buf)) == 0 && parse_list(buf, siblings, CPU_SETSIZE) == 0) {
+					for (leader = 0; leader < cpu && !isset(siblings, leader); leader++)
+						;
+				}
+				if (leader != cpu)
+					continue;
+			}
+			CPU_SET(cpu, set);
+			picked++;
+		}
+	}
+}
+
+/* bind to the CPUs of spec, either a list like `0-3,8` or `near:device[:n]` for n cores nearest to device */
+void place_cpus(char *spec) {
+	unsigned long cpus[CPU_SETSIZE / LONG_BITS];
+	cpu_set_t     set;
+	char         *dev, *count;
+
+	if (!strncmp(spec, "near:", 5)) {
+		dev = spec + 5;
+		/* PCI-addresses contain colons as well, the count is all digits */
+		if ((count = strrchr(dev, ':')) != NULL && count[1] && count[1 + strspn(count + 1, "0123456789")] == '\0')
+			*count++ = '\0';
+		else
+			count = NULL;
+		node_cpus(device_node(dev), count ? atoi(count) : 0, &set);
+	} else {
+		if (parse_list(spec, cpus, CPU_SETSIZE) == -1) {
+			fprintf(stderr, "%s: invalid CPU list `%s`\n", self, spec);
+			exit(100);
+		}
+		CPU_ZERO(&set);
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (isset(cpus, cpu))
+				CPU_SET(cpu, &set);
+		}
+	}
+
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		FAIL_ERRNO(101, "unable to set CPU affinity");
+
+	if (verbose) {
+		fprintf(stderr, "%s: running on CPU", self);
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &set))
+				fprintf(stderr, " %d", cpu);
+		}
+		fprintf(stderr, "\n");
+	}
+}
+
+/* set the NUMA memory policy of spec, `policy[:nodes]` where nodes is a list or `near:device` */
+void place_memory(char *spec) {
+	unsigned long nodes[NODEMASK_BITS / LONG_BITS] = { 0 };
+	char         *list;
+	int           mode = -1, neednodes = 0, node;
+
+	if ((list = strchr(spec, ':')) != NULL)
+		*list++ = '\0';
+
+	for (size_t i = 0; i < sizeof(mempolicies) / sizeof(*mempolicies); i++) {
+		if (!strcmp(spec, mempolicies[i].name)) {
+			mode      = mempolicies[i].mode;
+			neednodes = mempolicies[i].nodes;
+		}
+	}
+	if (mode == -1 || neednodes != (list != NULL)) {
+		fprintf(stderr, "%s: invalid memory policy `%s`\n", self, spec);
+		exit(100);
+	}
+
+	if (list && !strncmp(list, "near:", 5)) {
+		/* a device without a known node falls back to the first */
+		if ((node = device_node(list + 5)) < 0)
+			node = 0;
+		nodes[node / LONG_BITS] |= 1UL << (node % LONG_BITS);
+	} else if (list && parse_list(list, nodes, NODEMASK_BITS) == -1) {
+		fprintf(stderr, "%s: invalid node list `%s`\n", self, list);
+		exit(100);
+	}
+
+	/* the kernel expects one bit more than the mask holds */
+	if (syscall(SYS_set_mempolicy, mode, list ? nodes : NULL, list ? NODEMASK_BITS + 1 : 0) == -1)
+		FAIL_ERRNO(101, "unable to set memory policy");
+}
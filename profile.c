@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PROFILE_MAGIC  "ENVMODP\1"
+#define PROFILE_SUFFIX ".compiled"
+#define PROFILE_WORDS  256
+#define PROFILE_SIZE   (PROFILE_WORDS * 256) /* bytes of the source */
+
+
+/* a compiled profile is the header, the inputs and a string-table holding the words,
+ * the envdir- and envfile-changes and the paths of the inputs, each terminated by NUL */
+struct profile_header {
+	char     magic[8];
+	uint32_t nwords;
+	uint32_t nops[PROFILE_SECTIONS];
+	uint32_t ninputs;
+	uint32_t strsize;
+};
+
+/* a file the profile was compiled from, the profile is stale once one of them changed */
+struct profile_input {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t  size;
+	int64_t  mtime_sec;
+	int64_t  mtime_nsec;
+	int64_t  ctime_sec;
+	int64_t  ctime_nsec;
+};
+
+struct strlist {
+	char **strs;
+	size_t len, alloc;
+};
+
+static char          *words[PROFILE_WORDS];
+static int            drop[PROFILE_WORDS];
+static int            nwords;
+static struct strlist ops[PROFILE_SECTIONS];
+static struct strlist inputpaths;
+static struct profile_input *inputs;
+static size_t         inputsalloc;
+static int            compiled;   /* the profile was loaded from its compiled form */
+static int            compiling;  /* the compiled form is written by profile_save() */
+static int            failed;     /* an input could not be read completely, the compiled form would be wrong */
+static int            keepusers;  /* a user is resolved on every launch, -G, -N and -K must stay */
+static int            blocked[PROFILE_SECTIONS];
+static int            recording = -1;
+static char          *imagepath; /* relative to imagedir, which stays valid after chroot and chdir */
+static int            imagedir = -1;
+
+
+static void strlist_add(struct strlist *list, char *str) {
+	char **newstrs;
+
+	if (list->len == list->alloc) {
+		list->alloc = list->alloc ? list->alloc * 2 : 64;
+		if ((newstrs = realloc(list->strs, list->alloc * sizeof(*newstrs))) == NULL) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		list->strs = newstrs;
+	}
+	list->strs[list->len++] = str;
+}
+
+static int profile_word(const char *str) {
+	for (int i = 0; i < nwords; i++) {
+		if (words[i] == str)
+			return i;
+	}
+	return -1;
+}
+
+static int samestat(const struct profile_input *input, const struct stat *st) {
+	return input->dev == st->st_dev && input->ino == st->st_ino && input->size == st->st_size &&
+	       input->mtime_sec == st->st_mtim.tv_sec && input->mtime_nsec == st->st_mtim.tv_nsec &&
+	       input->ctime_sec == st->st_ctim.tv_sec && input->ctime_nsec == st->st_ctim.tv_nsec;
+}
+
+/* load the compiled profile at path, returns 0 if it is missing, invalid or stale */
+static int profile_loadimage(const char *path) {
+	struct profile_header       header;
+	const struct profile_input *stored;
+	struct stat                 st;
+	char                       *data, *str, *end;
+	size_t                      size;
+	int                         fd;
+
+	if ((fd = openat(imagedir, path, O_RDONLY | O_CLOEXEC)) == -1)
+		return 0;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(header) || (data = malloc(st.st_size)) == NULL) {
+		close(fd);
+		return 0;
+	}
+	size = read(fd, data, st.st_size);
+	close(fd);
+
+	memcpy(&header, data, sizeof(header));
+	if (size != (size_t) st.st_size || memcmp(header.magic, PROFILE_MAGIC, sizeof(header.magic)) ||
+	    header.nwords > PROFILE_WORDS ||
+	    size != sizeof(header) + header.ninputs * sizeof(*stored) + header.strsize || header.strsize == 0 ||
+	    data[size - 1] != '\0')
+		goto invalid;
+
+	stored = (const struct profile_input *) (data + sizeof(header));
+	str    = data + sizeof(header) + header.ninputs * sizeof(*stored);
+	end    = data + size;
+
+	for (uint32_t i = 0; i < header.nwords && str < end; i++, str += strlen(str) + 1)
+		words[nwords++] = str;
+	for (int s = 0; s < PROFILE_SECTIONS; s++) {
+		for (uint32_t i = 0; i < header.nops[s] && str < end; i++, str += strlen(str) + 1)
+			strlist_add(&ops[s], str);
+	}
+	for (uint32_t i = 0; i < header.ninputs; i++, str += strlen(str) + 1) {
+		if (str >= end || stat(str, &st) == -1 || !samestat(&stored[i], &st))
+			goto invalid;
+	}
+	return 1;
+
+invalid:
+	nwords = 0;
+	for (int s = 0; s < PROFILE_SECTIONS; s++)
+		ops[s].len = 0;
+	free(data);
+	return 0;
+}
+
+/* split the profile into words, separated by whitespace and optionally quoted, `#` starts a comment */
+static void profile_parse(const char *path) {
+	char   *data, *p, *word, quote;
+	size_t  size = 0;
+	ssize_t n;
+	int     fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		FAIL_ERRNO(101, "unable to open profile `%s`", path);
+	if ((data = malloc(PROFILE_SIZE + 1)) == NULL)
+		FAIL_ERRNO(102, "unable to allocate memory");
+	/* read one byte more than allowed to tell a profile of exactly PROFILE_SIZE from a longer one */
+	while (size <= PROFILE_SIZE && (n = read(fd, data + size, PROFILE_SIZE + 1 - size)) != 0) {
+		if (n == -1 && errno != EINTR)
+			FAIL_ERRNO(101, "unable to read profile `%s`", path);
+		if (n > 0)
+			size += n;
+	}
+	close(fd);
+	if (size > PROFILE_SIZE) {
+		fprintf(stderr, "%s: profile `%s` is too long, at most %d bytes\n", self, path, PROFILE_SIZE);
+		exit(100);
+	}
+	data[size] = '\0';
+
+	for (p = data; *p;) {
+		if (isspace((unsigned char) *p)) {
+			p++;
+			continue;
+		}
+		if (*p == '#') {
+			p += strcspn(p, "\n");
+			continue;
+		}
+
+		if (nwords == PROFILE_WORDS) {
+			fprintf(stderr, "%s: profile `%s` is too long, at most %d words\n", self, path, PROFILE_WORDS);
+			exit(100);
+		}
+		words[nwords++] = word = p;
+		for (quote = 0; *p && (quote || !isspace((unsigned char) *p)); p++) {
+			if (!quote && (*p == '"' || *p == '\'')) {
+				quote = *p;
+			} else if (quote && *p == quote) {
+				quote = 0;
+			} else {
+				*word++ = *p;
+			}
+		}
+		if (quote) {
+			fprintf(stderr, "%s: unterminated quote in profile `%s`\n", self, path);
+			exit(100);
+		}
+		if (*p)
+			p++;
+		*word = '\0';
+	}
+}
+
+/* remember path and its state before it is read */
+static void profile_input(char *path) {
+	struct profile_input *newinputs;
+	struct stat           st;
+
+	if (inputpaths.len == inputsalloc) {
+		inputsalloc = inputsalloc ? inputsalloc * 2 : 64;
+		if ((newinputs = realloc(inputs, inputsalloc * sizeof(*newinputs))) == NULL) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		inputs = newinputs;
+	}
+	/* a missing input is never the same, the profile is compiled again next time */
+	memset(&inputs[inputpaths.len], 0, sizeof(*inputs));
+	if (stat(path, &st) == 0) {
+		inputs[inputpaths.len] = (struct profile_input){
+			.dev        = st.st_dev,
+			.ino        = st.st_ino,
+			.size       = st.st_size,
+			.mtime_sec  = st.st_mtim.tv_sec,
+			.mtime_nsec = st.st_mtim.tv_nsec,
+			.ctime_sec  = st.st_ctim.tv_sec,
+			.ctime_nsec = st.st_ctim.tv_nsec,
+		};
+	}
+	strlist_add(&inputpaths, path);
+}
+
+/* load the profile at path and insert its words into the arguments in place of `-@ path`,
+ * the compiled form next to it is used if it is up to date */
+void profile_load(const char *path, int *argc, char ***argv) {
+	char **newargv, *abspath, *base;
+	int    n = 0;
+
+	/* the profile is recorded as input, which must be found after chdir */
+	if ((abspath = realpath(path, NULL)) == NULL)
+		FAIL_ERRNO(101, "unable to open profile `%s`", path);
+	base  = strrchr(abspath, '/');
+	*base = '\0';
+	if ((imagedir = movefd(open(*abspath ? abspath : "/", O_PATH | O_DIRECTORY | O_CLOEXEC), 1)) == -1)
+		FAIL_ERRNO(101, "unable to open directory of profile `%s`", path);
+	*base = '/';
+	if (asprintf(&imagepath, "%s%s", base + 1, PROFILE_SUFFIX) == -1)
+		FAIL_ERRNO(102, "unable to allocate memory");
+
+	if (profile_loadimage(imagepath)) {
+		compiled = 1;
+	} else {
+		profile_input(abspath);
+		profile_parse(abspath);
+		compiling = 1;
+	}
+
+	if ((newargv = malloc((*argc - 2 + nwords + 1) * sizeof(*newargv))) == NULL)
+		FAIL_ERRNO(102, "unable to allocate memory");
+	newargv[n++] = (*argv)[0];
+	for (int i = 0; i < nwords; i++)
+		newargv[n++] = words[i];
+	for (int i = 3; i < *argc; i++)
+		newargv[n++] = (*argv)[i];
+	newargv[n] = NULL;
+
+	*argc = n;
+	*argv = newargv;
+}
+
+/* store the numeric form of a user resolved from the profile. Only users looked up in the files are compiled,
+ * NSS-sources and the cache of -K change without notice, unlike the mtime of /etc/passwd and /etc/group. */
+void profile_user(const char *spec, uid_t uid, const gid_t *gids, int ngids) {
+	char *numeric;
+	int   i, len;
+
+	if (!compiling)
+		return;
+	if ((i = profile_word(spec)) == -1 || ugid_nss || ugid_cache) {
+		keepusers = 1;
+		return;
+	}
+
+	if ((numeric = malloc(12 * (ngids + 1) + 1)) == NULL)
+		FAIL_ERRNO(102, "unable to allocate memory");
+	len = sprintf(numeric, ":%u", uid);
+	for (int j = 0; j < ngids; j++)
+		len += sprintf(numeric + len, ":%u", gids[j]);
+	words[i] = numeric;
+
+	profile_input(strdup(PASSWD_PATH));
+	profile_input(strdup(GROUP_PATH));
+}
+
+static void record(const char *name, size_t namelen, const char *value, size_t valuelen) {
+	char *op;
+
+	if (value == NULL)
+		op = strndup(name, namelen);
+	else if (asprintf(&op, "%.*s=%.*s", (int) namelen, name, (int) valuelen, value) == -1)
+		op = NULL;
+	if (op == NULL)
+		FAIL_ERRNO(102, "unable to allocate memory");
+	strlist_add(&ops[recording], op);
+}
+
+/* record the changes of the envdir or envfile at path if it is part of the profile, which is only
+ * possible for absolute paths outside of a chroot and as long as no previous source was skipped */
+void profile_record(int section, const char *path, int chrooted) {
+	struct dirent *entry;
+	DIR           *dir;
+	char          *file;
+	int            i;
+
+	env_recorder = NULL;
+	recording    = -1;
+	if (!compiling || path == NULL || (i = profile_word(path)) == -1)
+		return;
+	if (blocked[section] || chrooted || path[0] != '/' || i == 0 || strlen(words[i - 1]) != 2) {
+		blocked[section] = 1;
+		return;
+	}
+
+	profile_input(strdup(path));
+	if (section == PROFILE_ENVDIR) {
+		/* the directory itself only changes if entries are added or removed */
+		if ((dir = opendir(path)) == NULL)
+			return;
+		while ((entry = readdir(dir)) != NULL) {
+			if (entry->d_name[0] == '.')
+				continue;
+			if (asprintf(&file, "%s/%s", path, entry->d_name) == -1)
+				FAIL_ERRNO(102, "unable to allocate memory");
+			profile_input(file);
+		}
+		closedir(dir);
+	}
+
+	drop[i - 1] = drop[i] = 1;
+	recording           = section;
+	env_recorder        = record;
+}
+
+/* an entry of the envdir being recorded could not be read, its change is missing from the record */
+void profile_fail(void) {
+	if (recording != -1)
+		failed = 1;
+}
+
+/* apply the changes of the envdirs or envfiles of a compiled profile */
+void profile_env(int section) {
+	if (!compiled)
+		return;
+	for (size_t i = 0; i < ops[section].len; i++) {
+		if (strchr(ops[section].strs[i], '=') != NULL)
+			env_put(ops[section].strs[i]);
+		else
+			env_unset(ops[section].strs[i], strlen(ops[section].strs[i]));
+	}
+}
+
+static int writestr(FILE *fp, const char *str, uint32_t *strsize) {
+	*strsize += strlen(str) + 1;
+	return fwrite(str, strlen(str) + 1, 1, fp) == 1 ? 0 : -1;
+}
+
+/* write the compiled form of the profile loaded from its source, private as it holds the environment */
+void profile_save(void) {
+	struct profile_header header = { .magic = PROFILE_MAGIC };
+	char                 *tmppath;
+	FILE                 *fp;
+	int                   fd, err = 0;
+
+	env_recorder = NULL;
+	if (!compiling || failed)
+		return;
+	compiling = 0;
+
+	/* once every user is compiled, the lookups are compiled in completely */
+	for (int i = 0; i < nwords && !keepusers; i++) {
+		if (!strcmp(words[i], "-G") || !strcmp(words[i], "-N"))
+			drop[i] = 1;
+		else if (!strcmp(words[i], "-K") && i + 2 < nwords)
+			drop[i] = drop[i + 1] = drop[i + 2] = 1;
+	}
+
+	if (asprintf(&tmppath, "%s.%d", imagepath, getpid()) == -1)
+		FAIL_ERRNO(102, "unable to allocate memory");
+	if ((fd = openat(imagedir, tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		if (verbose)
+			FAIL_ERRNO(-1, "unable to write compiled profile `%s`", imagepath);
+		free(tmppath);
+		return;
+	}
+
+	for (int i = 0; i < nwords; i++)
+		header.nwords += !drop[i];
+	for (int s = 0; s < PROFILE_SECTIONS; s++)
+		header.nops[s] = ops[s].len;
+	header.ninputs = inputpaths.len;
+
+	/* the header is written last, once the size of the string-table is known */
+	fseek(fp, sizeof(header), SEEK_SET);
+	if (inputpaths.len > 0 && fwrite(inputs, sizeof(*inputs), inputpaths.len, fp) != inputpaths.len)
+		err = -1;
+	for (int i = 0; i < nwords && !err; i++) {
+		if (!drop[i])
+			err = writestr(fp, words[i], &header.strsize);
+	}
+	for (int s = 0; s < PROFILE_SECTIONS; s++) {
+		for (size_t i = 0; i < ops[s].len && !err; i++)
+			err = writestr(fp, ops[s].strs[i], &header.strsize);
+	}
+	for (size_t i = 0; i < inputpaths.len && !err; i++)
+		err = writestr(fp, inputpaths.strs[i], &header.strsize);
+
+	if (!err) {
+		rewind(fp);
+		err = fwrite(&header, sizeof(header), 1, fp) == 1 ? 0 : -1;
+	}
+	if (fclose(fp) == EOF || err || renameat(imagedir, tmppath, imagedir, imagepath) == -1) {
+		if (verbose)
+			FAIL_ERRNO(-1, "unable to write compiled profile `%s`", imagepath);
+		unlinkat(imagedir, tmppath, 0);
+	}
+	free(tmppath);
+}
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PSI_PERCENT 10  /* default stall-threshold in percent of the window */
+#define PSI_WINDOW  2   /* seconds, unprivileged triggers require a multiple of 2s */
+#define PSI_PERIOD  0.5 /* seconds of a stop/continue cycle */
+#define PSI_DUTY    25  /* default percentage of a cycle the child runs with action=stop */
+#define PSI_NICE    10  /* default increment with action=nice */
+
+
+enum {
+	PSI_MEMORY,
+	PSI_IO,
+	PSI_CPU,
+	PSI_RESOURCES,
+};
+
+enum {
+	OPT_FULL = PSI_RESOURCES,
+	OPT_WINDOW,
+	OPT_HOLD,
+	OPT_ACTION,
+};
+
+enum {
+	ACTION_STOP,
+	ACTION_FREEZE,
+	ACTION_NICE,
+};
+
+struct trigger {
+	struct source src; /* pressure-file with a registered trigger */
+	int           percent;
+};
+
+static char *const psiopts[] = {
+	[PSI_MEMORY] = "memory",
+	[PSI_IO]     = "io",
+	[PSI_CPU]    = "cpu",
+	[OPT_FULL]   = "full",
+	[OPT_WINDOW] = "window",
+	[OPT_HOLD]   = "hold",
+	[OPT_ACTION] = "action",
+	NULL,
+};
+
+static char *const actions[] = {
+	[ACTION_STOP]   = "stop",
+	[ACTION_FREEZE] = "freeze",
+	[ACTION_NICE]   = "nice",
+	NULL,
+};
+
+static struct trigger  triggers[PSI_RESOURCES];
+static int             psi_enabled, psi_full, psi_action = ACTION_STOP, psi_amount = -1;
+static double          psi_window = PSI_WINDOW, psi_hold = 0;
+static int             freezefd = -1;
+static struct source   ticksrc;
+static int             throttled, stopped;
+static int             basenice; /* the nice level of the child, restored with action=nice once the pressure subsided */
+static struct timespec throttlestart, lastevent;
+
+
+static void invalid(const char *what, const char *value) {
+	fprintf(stderr, "%s: invalid pressure %s `%s`\n", self, what, value ? value : "");
+	exit(100);
+}
+
+static double number(const char *what, const char *value) {
+	char  *end;
+	double num;
+
+	if (!value || (num = strtod(value, &end)) < 0 || end == value || *end)
+		invalid(what, value);
+	return num;
+}
+
+/* parse `resource[=percent][,...][,full][,window=seconds][,hold=seconds][,action=stop[:duty]|freeze|nice[:n]]` of -Y */
+void psi_parse(char *spec) {
+	char *value, *amount;
+	int   opt;
+
+	psi_enabled = 1;
+	while (*spec) {
+		switch (opt = getsubopt(&spec, psiopts, &value)) {
+			case PSI_MEMORY:
+			case PSI_IO:
+			case PSI_CPU:
+				triggers[opt].percent = value ? (int) number("threshold", value) : PSI_PERCENT;
+				if (triggers[opt].percent < 1 || triggers[opt].percent > 99)
+					invalid("threshold", value);
+				break;
+			case OPT_FULL:
+				psi_full = 1;
+				break;
+			case OPT_WINDOW:
+				psi_window = number("window", value);
+				break;
+			case OPT_HOLD:
+				psi_hold = number("hold", value);
+				break;
+			case OPT_ACTION:
+				if (!value)
+					invalid("action", value);
+				if ((amount = strchr(value, ':')) != NULL)
+					*amount++ = '\0';
+				for (psi_action = 0; actions[psi_action]; psi_action++) {
+					if (!strcmp(value, actions[psi_action]))
+						break;
+				}
+				if (!actions[psi_action] || (amount && psi_action == ACTION_FREEZE))
+					invalid("action", value);
+				if (amount && (psi_amount = (int) number("action", amount)) > 99)
+					invalid("action", amount);
+				break;
+			default:
+				invalid("option", value);
+		}
+	}
+
+	if (!triggers[PSI_MEMORY].percent && !triggers[PSI_IO].percent && !triggers[PSI_CPU].percent)
+		invalid("resource", "");
+	if (psi_amount == -1)
+		psi_amount = psi_action == ACTION_NICE ? PSI_NICE : PSI_DUTY;
+	if (psi_hold == 0)
+		psi_hold = 2 * psi_window;
+
+	/* a frozen cgroup would freeze envmod too */
+	if (psi_action == ACTION_FREEZE)
+		cgroup_spawn = 1;
+}
+
+/* register the triggers of -Y, preferring the pressure of the cgroup of -g over the system-wide one.
+ * Called before dropping privileges, as the supervisor only polls the triggers. */
+void psi_open(void) {
+	char path[PATH_MAX + 32], trigger[64];
+	int  fd, len;
+
+	if (!psi_enabled)
+		return;
+
+	if (psi_action == ACTION_FREEZE) {
+		if (!cgroup_dir[0]) {
+			fprintf(stderr, "%s: -Y action=freeze requires a cgroup (-g)\n", self);
+			exit(100);
+		}
+		snprintf(path, sizeof(path), "%s/cgroup.freeze", cgroup_dir);
+		if ((freezefd = movefd(open(path, O_WRONLY | O_CLOEXEC), 1)) == -1)
+			FAIL_ERRNO(101, "unable to open `%s`", path);
+	}
+
+	for (int i = 0; i < PSI_RESOURCES; i++) {
+		if (!triggers[i].percent)
+			continue;
+
+		fd = -1;
+		if (cgroup_dir[0]) {
+			snprintf(path, sizeof(path), "%s/%s.pressure", cgroup_dir, psiopts[i]);
+			fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		}
+		if (fd == -1) {
+			snprintf(path, sizeof(path), "/proc/pressure/%s", psiopts[i]);
+			if ((fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1)
+				FAIL_ERRNO(101, "unable to open `%s`", path);
+		}
+
+		/* the stall in µs per window, the trigger is written including its terminator */
+		len = snprintf(trigger, sizeof(trigger), "%s %ld %ld", psi_full ? "full" : "some",
+		               (long) (psi_window * 10000 * triggers[i].percent), (long) (psi_window * 1000000));
+		if (write(fd, trigger, len + 1) == -1)
+			FAIL_ERRNO(101, "unable to register trigger `%s` at `%s`", trigger, path);
+
+		if ((triggers[i].src.fd = movefd(fd, 1)) == -1)
+			FAIL_ERRNO(101, "unable to move pressure fd");
+	}
+}
+
+static double since(const struct timespec *ts) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - ts->tv_sec) + (now.tv_nsec - ts->tv_nsec) / 1e9;
+}
+
+static void stop(pid_t pid) {
+	kill(pid, SIGSTOP);
+}
+
+static void cont(pid_t pid) {
+	kill(pid, SIGCONT);
+}
+
+/* renice every thread of pid, the nice level belongs to a thread and not to the process */
+static void renice(pid_t pid) {
+	struct dirent *entry;
+	DIR           *dir;
+	char           path[32];
+	int            prio = throttled ? basenice + psi_amount : basenice;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	if ((dir = opendir(path)) == NULL) {
+		FAIL_ERRNO(-1, "unable to renice child %d", pid);
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		/* a thread may have exited meanwhile */
+		if (entry->d_name[0] != '.' && setpriority(PRIO_PROCESS, atoi(entry->d_name), prio) == -1 && errno != ESRCH)
+			FAIL_ERRNO(-1, "unable to renice child %d", pid);
+	}
+	closedir(dir);
+}
+
+static void setstopped(int on) {
+	stopped = on;
+	supervise_foreach(on ? stop : cont);
+}
+
+static void throttle(void) {
+	switch (psi_action) {
+		case ACTION_STOP:
+			setstopped(throttled);
+			if (throttled)
+				settimer(ticksrc.fd, PSI_PERIOD * (100 - psi_amount) / 100);
+			break;
+		case ACTION_FREEZE:
+			if (pwrite(freezefd, throttled ? "1" : "0", 1, 0) != 1)
+				FAIL_ERRNO(-1, "unable to %s cgroup", throttled ? "freeze" : "thaw");
+			break;
+		case ACTION_NICE:
+			supervise_foreach(renice);
+			break;
+	}
+	if (throttled && psi_action != ACTION_STOP)
+		settimer(ticksrc.fd, psi_hold);
+}
+
+static void handle_pressure(struct source *src) {
+	struct trigger *t = (struct trigger *) src;
+
+	clock_gettime(CLOCK_MONOTONIC, &lastevent);
+	if (throttled)
+		return;
+
+	fprintf(stderr, "%s: %s pressure above %d%%, throttling child\n", self, psiopts[t - triggers], t->percent);
+	throttlestart = lastevent;
+	throttled     = 1;
+	throttle();
+}
+
+/* resume the child once there was no trigger for the hold-time, cycle it with action=stop meanwhile */
+static void handle_tick(struct source *src) {
+	uint64_t expirations;
+	double   quiet;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) <= 0 || !throttled)
+		return;
+
+	if ((quiet = since(&lastevent)) >= psi_hold) {
+		throttled = 0;
+		throttle();
+		fprintf(stderr, "%s: pressure subsided, child was throttled for %.1fs\n", self, since(&throttlestart));
+		return;
+	}
+
+	if (psi_action != ACTION_STOP) {
+		settimer(ticksrc.fd, psi_hold - quiet);
+	} else if (psi_amount == 0) {
+		settimer(ticksrc.fd, PSI_PERIOD);
+	} else {
+		setstopped(!stopped);
+		settimer(ticksrc.fd, PSI_PERIOD * (stopped ? 100 - psi_amount : psi_amount) / 100);
+	}
+}
+
+/* resume the child if it is still throttled once the supervisor is done, e.g. thawing its cgroup */
+void psi_stop(void) {
+	if (!throttled)
+		return;
+
+	throttled = 0;
+	throttle();
+	fprintf(stderr, "%s: child was throttled for %.1fs\n", self, since(&throttlestart));
+}
+
+/* watch the triggers of psi_open() from the event-loop of the supervisor */
+void psi_start(void) {
+	struct rlimit rl;
+
+	if (!psi_enabled)
+		return;
+
+	/* the child inherits our nice level, lowering it again requires CAP_SYS_NICE or an RLIMIT_NICE allowing it */
+	if (psi_action == ACTION_NICE) {
+		basenice = getpriority(PRIO_PROCESS, 0);
+		if (geteuid() != 0 && (getrlimit(RLIMIT_NICE, &rl) == -1 || rl.rlim_cur < (rlim_t) (20 - basenice))) {
+			fprintf(stderr, "%s: -Y action=nice cannot be undone without privileges, e.g. after -u\n", self);
+			exit(100);
+		}
+	}
+
+	for (int i = 0; i < PSI_RESOURCES; i++) {
+		if (!triggers[i].percent)
+			continue;
+		triggers[i].src.handle = handle_pressure;
+		supervise_watch(&triggers[i].src, EPOLLPRI);
+	}
+
+	if ((ticksrc.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+		FAIL_ERRNO(102, "unable to create timerfd");
+	ticksrc.handle = handle_tick;
+	supervise_watch(&ticksrc, EPOLLIN);
+}
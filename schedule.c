@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef SCHED_DEADLINE
+#	define SCHED_DEADLINE 6
+#endif
+
+#define SCHED_FLAG_RESET_ON_FORK 0x01
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+
+/* as of linux/sched/types.h, which glibc does not provide */
+struct sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t  sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+enum {
+	OPT_POLICY,
+	OPT_PRIO,
+	OPT_IO,
+	OPT_SLACK,
+	OPT_RUNTIME,
+	OPT_DEADLINE,
+	OPT_PERIOD,
+};
+
+static char *const schedopts[] = {
+	[OPT_POLICY]   = "policy",
+	[OPT_PRIO]     = "prio",
+	[OPT_IO]       = "io",
+	[OPT_SLACK]    = "slack",
+	[OPT_RUNTIME]  = "runtime",
+	[OPT_DEADLINE] = "deadline",
+	[OPT_PERIOD]   = "period",
+	NULL,
+};
+
+static const struct {
+	const char *name;
+	int         policy;
+} policies[] = {
+	{ "other", SCHED_OTHER },
+	{ "batch", SCHED_BATCH },
+	{ "idle", SCHED_IDLE },
+	{ "fifo", SCHED_FIFO },
+	{ "rr", SCHED_RR },
+	{ "deadline", SCHED_DEADLINE },
+};
+
+static const char *const ioclasses[] = { "none", "rt", "be", "idle" };
+
+/* presets, options given after a preset override it */
+static const struct {
+	const char *name;
+	const char *spec;
+} presets[] = {
+	{ "batch", "policy=batch,io=be:7" },
+	{ "idle", "policy=idle,io=idle" },
+	{ "latency", "policy=fifo,prio=10,io=be:0,slack=1" },
+};
+
+
+static void invalid(const char *what, const char *value) {
+	fprintf(stderr, "%s: invalid scheduling %s `%s`\n", self, what, value ? value : "");
+	exit(100);
+}
+
+static unsigned long long number(const char *what, const char *value) {
+	char              *end;
+	unsigned long long n;
+
+	if (!value || !*value)
+		invalid(what, value);
+	n = strtoull(value, &end, 10);
+	if (*end)
+		invalid(what, value);
+	return n;
+}
+
+static void parse_schedule(char *spec, struct sched_attr *attr, int *setattr, int *ioprio, long *slack);
+
+/* expand the preset at the beginning of spec, returns 0 if there is none */
+static int parse_preset(char **spec, struct sched_attr *attr, int *setattr, int *ioprio, long *slack) {
+	char   buf[64];
+	size_t len;
+
+	for (size_t i = 0; i < sizeof(presets) / sizeof(*presets); i++) {
+		len = strlen(presets[i].name);
+		if (strncmp(*spec, presets[i].name, len) || ((*spec)[len] != ',' && (*spec)[len] != '\0'))
+			continue;
+
+		snprintf(buf, sizeof(buf), "%s", presets[i].spec);
+		parse_schedule(buf, attr, setattr, ioprio, slack);
+		*spec += len + ((*spec)[len] == ',');
+		return 1;
+	}
+	return 0;
+}
+
+static void parse_schedule(char *spec, struct sched_attr *attr, int *setattr, int *ioprio, long *slack) {
+	char *value, *level;
+	int   opt;
+
+	while (*spec) {
+		if (parse_preset(&spec, attr, setattr, ioprio, slack))
+			continue;
+
+		switch ((opt = getsubopt(&spec, schedopts, &value))) {
+			case OPT_POLICY:
+				attr->sched_policy = -1;
+				for (size_t i = 0; i < sizeof(policies) / sizeof(*policies); i++) {
+					if (value && !strcmp(value, policies[i].name))
+						attr->sched_policy = policies[i].policy;
+				}
+				if (attr->sched_policy == (uint32_t) -1)
+					invalid("policy", value);
+				*setattr = 1;
+				break;
+			case OPT_PRIO:
+				attr->sched_priority = number("priority", value);
+				*setattr             = 1;
+				break;
+			case OPT_IO:
+				if (!value)
+					invalid("io-class", value);
+				if ((level = strchr(value, ':')) != NULL)
+					*level++ = '\0';
+				*ioprio = -1;
+				for (int i = 1; i < 4; i++) {
+					if (!strcmp(value, ioclasses[i]))
+						*ioprio = i << IOPRIO_CLASS_SHIFT;
+				}
+				if (*ioprio == -1)
+					invalid("io-class", value);
+				if (level)
+					*ioprio |= number("io-level", level) & 7;
+				break;
+			case OPT_SLACK:
+				*slack = number("slack", value);
+				break;
+			case OPT_RUNTIME:
+			case OPT_DEADLINE:
+			case OPT_PERIOD:
+				attr->sched_policy = SCHED_DEADLINE;
+				*setattr           = 1;
+				if (opt == OPT_RUNTIME)
+					attr->sched_runtime = number("runtime", value);
+				else if (opt == OPT_DEADLINE)
+					attr->sched_deadline = number("deadline", value);
+				else
+					attr->sched_period = number("period", value);
+				break;
+			default:
+				invalid("option", value);
+		}
+	}
+}
+
+/* apply the scheduling profile spec, a preset and/or `key=value` pairs separated by commas,
+ * forking is set if envmod does not exec the command but spawns it */
+void set_schedule(char *spec, int forking) {
+	struct sched_attr attr    = { .size = sizeof(attr), .sched_policy = SCHED_OTHER };
+	int               setattr = 0, ioprio = -1;
+	long              slack   = -1;
+
+	parse_schedule(spec, &attr, &setattr, &ioprio, &slack);
+
+	if (setattr) {
+		/* keep the inherited nice level, -n is applied on top of it afterwards */
+		errno           = 0;
+		attr.sched_nice = getpriority(PRIO_PROCESS, 0);
+		if (errno != 0)
+			FAIL_ERRNO(101, "unable to get nice level");
+		if (attr.sched_policy == SCHED_DEADLINE) {
+			/* the command would be spawned as a child and run as SCHED_OTHER */
+			if (forking) {
+				fprintf(stderr, "%s: policy deadline cannot be used with -j or options implying -F\n", self);
+				exit(100);
+			}
+			if (attr.sched_deadline == 0)
+				attr.sched_deadline = attr.sched_period;
+			/* deadline-tasks may not fork, their children fall back to SCHED_OTHER instead */
+			attr.sched_flags |= SCHED_FLAG_RESET_ON_FORK;
+		}
+		if (syscall(SYS_sched_setattr, 0, &attr, 0) == -1)
+			FAIL_ERRNO(101, "unable to set scheduling policy");
+	}
+
+	if (ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == -1)
+		FAIL_ERRNO(101, "unable to set io priority");
+
+	if (slack != -1 && prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0) == -1)
+		FAIL_ERRNO(101, "unable to set timer slack");
+}
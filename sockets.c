@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define LISTEN_FDBASE 3 /* SD_LISTEN_FDS_START */
+#define NAME_MAX_LEN  255
+
+
+enum {
+	OPT_REUSEPORT,
+	OPT_BACKLOG,
+	OPT_DEFER,
+	OPT_FASTOPEN,
+	OPT_NAME,
+};
+
+static char *const listenopts[] = {
+	[OPT_REUSEPORT] = "reuseport",
+	[OPT_BACKLOG]   = "backlog",
+	[OPT_DEFER]     = "defer",
+	[OPT_FASTOPEN]  = "fastopen",
+	[OPT_NAME]      = "name",
+	NULL,
+};
+
+/* reuseport-sockets are opened once per worker of -W, so the kernel balances connections between them */
+struct listener {
+	int         fd; /* the socket of the first worker */
+	int        *copies;
+	int         ncopies;
+	const char *name;
+};
+
+static struct listener listeners[LISTEN_MAX];
+static int             nlisteners;
+static char            listenpid[32];
+static int             workerfds[LISTEN_MAX];
+
+
+static int islistener(int fd) {
+	for (int i = 0; i < nlisteners; i++) {
+		if (listeners[i].fd == fd)
+			return 1;
+		for (int j = 0; j < listeners[i].ncopies; j++) {
+			if (listeners[i].copies[j] == fd)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static void invalid(const char *what, const char *value) {
+	fprintf(stderr, "%s: invalid socket %s `%s`\n", self, what, value ? value : "");
+	exit(100);
+}
+
+static int number(const char *what, const char *value) {
+	char *end;
+	long  n;
+
+	if (!value || !*value)
+		invalid(what, value);
+	n = strtol(value, &end, 10);
+	if (*end || n < 0)
+		invalid(what, value);
+	return n;
+}
+
+static void setopt(int fd, int level, int opt, int value, const char *what) {
+	if (setsockopt(fd, level, opt, &value, sizeof(value)) == -1)
+		FAIL_ERRNO(101, "unable to set %s", what);
+}
+
+static int open_unix(const char *path, int type) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat        st;
+	socklen_t          len;
+	int                fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		invalid("path", path);
+	strcpy(addr.sun_path, path);
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+
+	if (path[0] == '@') {
+		/* abstract socket, not bound to the filesystem */
+		addr.sun_path[0] = '\0';
+		len--;
+	} else if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		/* a socket left by the previous instance */
+		unlink(path);
+	}
+
+	if ((fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0)) == -1)
+		FAIL_ERRNO(101, "unable to create socket");
+	if (bind(fd, (struct sockaddr *) &addr, len) == -1)
+		FAIL_ERRNO(101, "unable to bind `%s`", path);
+	return fd;
+}
+
+#ifdef ENVMOD_STATIC
+/* getaddrinfo() requires NSS-modules a static binary cannot load, only numeric addresses are supported */
+static void resolve(const char *address, const char *host, const char *port, int type, struct addrinfo **res) {
+	static struct sockaddr_storage addr;
+	static struct addrinfo         info;
+	struct sockaddr_in            *in  = (struct sockaddr_in *) &addr;
+	struct sockaddr_in6           *in6 = (struct sockaddr_in6 *) &addr;
+	char                          *end;
+	long                           portnum;
+
+	portnum = strtol(port, &end, 10);
+	if (!*port || *end || portnum < 0 || portnum > 65535)
+		invalid("port", port);
+
+	memset(&addr, 0, sizeof(addr));
+	if (host == NULL || inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+		in->sin_family  = AF_INET;
+		in->sin_port    = htons(portnum);
+		info.ai_addrlen = sizeof(*in);
+	} else if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port   = htons(portnum);
+		info.ai_addrlen  = sizeof(*in6);
+	} else {
+		fprintf(stderr, "%s: unable to resolve `%s`: only numeric addresses are supported\n", self, address);
+		exit(101);
+	}
+	info.ai_family   = addr.ss_family;
+	info.ai_socktype = type;
+	info.ai_addr     = (struct sockaddr *) &addr;
+	*res             = &info;
+}
+
+#	define freeaddrinfo(res) ((void) (res))
+#else
+static void resolve(const char *address, const char *host, const char *port, int type, struct addrinfo **res) {
+	struct addrinfo hints = { .ai_flags = AI_PASSIVE | AI_NUMERICSERV, .ai_socktype = type };
+	int             err;
+
+	if ((err = getaddrinfo(host, port, &hints, res)) != 0) {
+		fprintf(stderr, "%s: unable to resolve `%s`: %s\n", self, address, gai_strerror(err));
+		exit(101);
+	}
+}
+#endif
+
+static int open_inet(char *address, int type, int reuseport) {
+	struct addrinfo *res;
+	char            *host = address, *port;
+	int              fd;
+
+	if (host[0] == '[') {
+		/* [v6-address]:port */
+		host++;
+		if ((port = strchr(host, ']')) == NULL || port[1] != ':')
+			invalid("address", address);
+		*port = '\0';
+		port += 2;
+	} else if ((port = strrchr(host, ':')) != NULL) {
+		*port++ = '\0';
+	} else {
+		invalid("address", address);
+	}
+	if (!*host || !strcmp(host, "*"))
+		host = NULL;
+
+	resolve(address, host, port, type, &res);
+
+	if ((fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol)) == -1)
+		FAIL_ERRNO(101, "unable to create socket");
+	setopt(fd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+	if (reuseport)
+		setopt(fd, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+	if (bind(fd, res->ai_addr, res->ai_addrlen) == -1)
+		FAIL_ERRNO(101, "unable to bind `%s`", address);
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* open one socket of listen_open() */
+static int open_socket(const char *proto, const char *address, int reuseport, int backlog, int defer, int fastopen) {
+	char buf[256];
+	int  fd, stream, tcp = 0;
+
+	/* the address is modified while parsing */
+	snprintf(buf, sizeof(buf), "%s", address);
+
+	if (!strcmp(proto, "tcp")) {
+		tcp    = 1;
+		stream = 1;
+		fd     = open_inet(buf, SOCK_STREAM, reuseport);
+	} else if (!strcmp(proto, "udp")) {
+		stream = 0;
+		fd     = open_inet(buf, SOCK_DGRAM, reuseport);
+	} else if (!strcmp(proto, "unix")) {
+		stream = 1;
+		fd     = open_unix(buf, SOCK_STREAM);
+	} else if (!strcmp(proto, "unixdgram")) {
+		stream = 0;
+		fd     = open_unix(buf, SOCK_DGRAM);
+	} else {
+		invalid("protocol", proto);
+	}
+
+	if (tcp && defer)
+		setopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer, "TCP_DEFER_ACCEPT");
+	if (tcp && fastopen)
+		setopt(fd, IPPROTO_TCP, TCP_FASTOPEN, fastopen, "TCP_FASTOPEN");
+	if (stream && listen(fd, backlog) == -1)
+		FAIL_ERRNO(101, "unable to listen on `%s`", address);
+
+	return fd;
+}
+
+/* open the listening socket of spec, `tcp:host:port`, `udp:host:port`, `unix:path` or `unixdgram:path`
+ * followed by comma-separated options. With reuseport, one socket is opened for each of `workers`. */
+void listen_open(char *spec, int workers) {
+	struct listener *lst;
+	char            *opts, *value, *address;
+	int              fd, reuseport = 0, backlog = SOMAXCONN, defer = 0, fastopen = 0;
+	char            *name = "unknown";
+
+	if (nlisteners == LISTEN_MAX) {
+		fprintf(stderr, "%s: too many sockets, at most %d\n", self, LISTEN_MAX);
+		exit(100);
+	}
+
+	if ((opts = strchr(spec, ',')) != NULL)
+		*opts++ = '\0';
+	while (opts && *opts) {
+		switch (getsubopt(&opts, listenopts, &value)) {
+			case OPT_REUSEPORT:
+				reuseport = 1;
+				break;
+			case OPT_BACKLOG:
+				backlog = number("backlog", value);
+				break;
+			case OPT_DEFER:
+				defer = number("defer", value);
+				break;
+			case OPT_FASTOPEN:
+				fastopen = number("fastopen", value);
+				break;
+			case OPT_NAME:
+				/* names are separated by colons in LISTEN_FDNAMES */
+				if (!value || !*value || strchr(value, ':') || strlen(value) > NAME_MAX_LEN)
+					invalid("name", value);
+				name = value;
+				break;
+			default:
+				invalid("option", value);
+		}
+	}
+
+	if ((address = strchr(spec, ':')) == NULL)
+		invalid("address", spec);
+	*address++ = '\0';
+
+	/* a unix socket is unlinked and bound again for every copy, the workers share a single one instead */
+	if (reuseport && strcmp(spec, "tcp") && strcmp(spec, "udp"))
+		reuseport = 0;
+
+	lst          = &listeners[nlisteners++];
+	lst->name    = name;
+	lst->ncopies = reuseport && workers > 1 ? workers - 1 : 0;
+	if (lst->ncopies > 0 && (lst->copies = calloc(lst->ncopies, sizeof(int))) == NULL) {
+		FAIL_ERRNO(102, "unable to allocate memory");
+	}
+
+	for (int i = 0; i <= lst->ncopies; i++) {
+		if ((fd = movefd(open_socket(spec, address, reuseport, backlog, defer, fastopen), 1)) == -1)
+			FAIL_ERRNO(101, "unable to move socket");
+		if (i == 0)
+			lst->fd = fd;
+		else
+			lst->copies[i - 1] = fd;
+	}
+}
+
+/* announce the sockets like systemd, the pid is filled in by spawn() if the command is forked */
+void listen_env(void) {
+	char   count[12], names[LISTEN_MAX * (NAME_MAX_LEN + 1)];
+	size_t len = 0;
+	int    n;
+
+	if (nlisteners == 0)
+		return;
+
+	n = snprintf(count, sizeof(count), "%d", nlisteners);
+	env_set("LISTEN_FDS", 10, count, n);
+
+	for (int i = 0; i < nlisteners; i++)
+		len += snprintf(names + len, sizeof(names) - len, "%s%s", i ? ":" : "", listeners[i].name);
+	env_set("LISTEN_FDNAMES", 14, names, len);
+
+	snprintf(listenpid, sizeof(listenpid), "LISTEN_PID=%d", getpid());
+	env_put(listenpid);
+	spawn_pidvar = listenpid + 11;
+}
+
+/* move the sockets to fd 3 and following, where they are inherited by the command */
+void listen_pass(void) {
+	int flags, fd;
+
+	if (nlisteners == 0)
+		return;
+
+	/* make room: move everything else out of the way, e.g. the lock of -l */
+	for (fd = LISTEN_FDBASE; fd < LISTEN_FDBASE + nlisteners; fd++) {
+		if (islistener(fd) || (flags = fcntl(fd, F_GETFD)) == -1)
+			continue;
+		if (fcntl(fd, (flags & FD_CLOEXEC) ? F_DUPFD_CLOEXEC : F_DUPFD, LISTEN_FDBASE + nlisteners) == -1)
+			FAIL_ERRNO(101, "unable to move fd %d", fd);
+		close(fd);
+	}
+
+	/* the sockets themselves may also occupy each other's place */
+	for (int i = 0; i < nlisteners; i++) {
+		if ((fd = fcntl(listeners[i].fd, F_DUPFD_CLOEXEC, LISTEN_FDBASE + nlisteners)) == -1)
+			FAIL_ERRNO(101, "unable to move socket");
+		close(listeners[i].fd);
+		listeners[i].fd = fd;
+	}
+	for (int i = 0; i < nlisteners; i++) {
+		/* dup2() clears FD_CLOEXEC */
+		if (dup2(listeners[i].fd, LISTEN_FDBASE + i) == -1)
+			FAIL_ERRNO(101, "unable to pass socket");
+		close(listeners[i].fd);
+		listeners[i].fd = LISTEN_FDBASE + i;
+	}
+}
+
+/* let spawn() pass the sockets of worker instead of the first worker's */
+void listen_worker(int worker) {
+	int remap = 0;
+
+	for (int i = 0; i < nlisteners; i++) {
+		workerfds[i] = -1;
+		if (worker > 0 && listeners[i].ncopies > 0) {
+			workerfds[i] = listeners[i].copies[(worker - 1) % listeners[i].ncopies];
+			remap        = 1;
+		}
+	}
+	spawn_fds  = remap ? workerfds : NULL;
+	spawn_nfds = nlisteners;
+}
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CLONE_PIDFD
+#	define CLONE_PIDFD 0x00001000
+#endif
+
+#define SPAWN_STACK       (64 * 1024)
+#define SPAWN_BACKOFF_MIN 1000000L    /* 1ms */
+#define SPAWN_BACKOFF_MAX 1000000000L /* 1s */
+
+
+struct spawnargs {
+	const char     *file;
+	char          **argv;
+	char          **envp;
+	const sigset_t *mask;
+};
+
+static void *spawnstack;
+
+char      *spawn_pidvar;
+const int *spawn_fds; /* if set, spawn_fds[i] is duplicated to fd 3 + i in the child, unless it is -1 */
+int        spawn_nfds;
+int        spawn_setpgid;       /* if set, the child becomes the leader of a new process group */
+int        spawn_cgroupfd = -1; /* if set, the child moves itself into the cgroup of this cgroup.procs */
+int        spawn_logfd    = -1; /* if set, duplicated to the child's stdout and stderr */
+
+
+/* runs in the child which shares the parent's memory until it execs, so nothing may be modified here */
+static int spawn_child(void *arg) {
+	struct spawnargs *args = arg;
+	char              digits[12], *var = spawn_pidvar;
+	int               n = 0;
+
+	/* the only exception: the child's pid is only known here, it is written into the environment-string
+	 * of spawn_pidvar, which is not used by the parent */
+	if (var) {
+		for (pid_t pid = getpid(); pid > 0 || n == 0; pid /= 10)
+			digits[n++] = '0' + pid % 10;
+		while (n > 0)
+			*var++ = digits[--n];
+		*var = '\0';
+	}
+
+	/* the child has its own fd-table */
+	if (spawn_logfd != -1) {
+		dup2(spawn_logfd, STDOUT_FILENO);
+		dup2(spawn_logfd, STDERR_FILENO);
+	}
+	for (int i = 0; spawn_fds && i < spawn_nfds; i++) {
+		if (spawn_fds[i] != -1)
+			dup2(spawn_fds[i], 3 + i);
+	}
+
+	if (spawn_setpgid)
+		setpgid(0, 0);
+	if (spawn_cgroupfd != -1 && write(spawn_cgroupfd, "0", 1) != 1) {
+		dprintf(STDERR_FILENO, "%s: unable to enter cgroup: %s\n", self, strerror(errno));
+		_exit(101);
+	}
+	if (args->mask)
+		sigprocmask(SIG_SETMASK, args->mask, NULL);
+	execvpe(args->file, args->argv, args->envp);
+	dprintf(STDERR_FILENO, "%s: unable to execute `%s`: %s\n", self, args->file, strerror(errno));
+	_exit(127);
+}
+
+int pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void) pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* start file without copying our address space: the child borrows it like vfork(2) until it execs.
+ * If pidfd is not NULL, it receives a pidfd of the child or -1 if pidfds are not supported.
+ * Failing clones are retried `tries` times (0 for unlimited) with an exponential, capped backoff. */
+pid_t spawn(const char *file, char **argv, char **envp, const sigset_t *mask, int *pidfd, int tries) {
+	struct spawnargs args  = { file, argv, envp, mask };
+	long             delay = SPAWN_BACKOFF_MIN;
+	int              flags = CLONE_VM | CLONE_VFORK | SIGCHLD;
+	int              fd    = -1;
+	pid_t            pid;
+
+	if (spawnstack == NULL) {
+		spawnstack = mmap(NULL, SPAWN_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		if (spawnstack == MAP_FAILED) {
+			spawnstack = NULL;
+			FAIL_ERRNO(102, "unable to allocate spawn-stack");
+		}
+	}
+
+	if (pidfd)
+		flags |= CLONE_PIDFD;
+
+	/* the stack grows down on every architecture we care about */
+	while ((pid = clone(spawn_child, (char *) spawnstack + SPAWN_STACK, flags, &args, &fd)) == -1) {
+		if (errno == EINVAL && (flags & CLONE_PIDFD)) {
+			/* kernel without CLONE_PIDFD, fall back to pidfd_open() */
+			flags &= ~CLONE_PIDFD;
+			continue;
+		}
+		if (tries > 0 && --tries == 0) {
+			FAIL_ERRNO(-1, "unable to spawn `%s`", file);
+			return -1;
+		}
+		FAIL_ERRNO(-1, "unable to spawn `%s`, retrying", file);
+		nanosleep(&(struct timespec){ delay / 1000000000L, delay % 1000000000L }, NULL);
+		if ((delay *= 2) > SPAWN_BACKOFF_MAX)
+			delay = SPAWN_BACKOFF_MAX;
+	}
+
+	if (pidfd) {
+		if (!(flags & CLONE_PIDFD) || fd < 0)
+			fd = pidfd_open(pid);
+		*pidfd = fd;
+	}
+
+	return pid;
+}
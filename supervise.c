@@ -0,0 +1,590 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+#include "signames.h"
+
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXEVENTS        16
+#define MAXSIGINFO       32
+#define SPAWN_TRAP_TRIES 5
+#define RESPAWN_DELAY    1 /* seconds a worker must run, or it is respawned delayed */
+#define TIMEOUT_GRACE    5 /* seconds between the signal of -Z and SIGKILL */
+
+
+struct process {
+	struct source  src; /* readable pidfd, fd is -1 if pidfds are not supported */
+	pid_t          pid;
+	int            status;
+	int            exited;
+	int            measure; /* collect usage and io when reaping */
+	struct rusage  usage;
+	struct iousage io;
+};
+
+/* at most one handler per signal is running, signals arriving meanwhile run it once more afterwards */
+struct trap {
+	struct process proc;
+	int            pending;
+};
+
+struct worker {
+	struct process  proc;
+	struct timespec started;
+	int             respawn; /* waiting for the respawn-timer */
+};
+
+enum {
+	EXIT_ANY,   /* stop every worker once one exits */
+	EXIT_ALL,   /* wait until every worker exited */
+	EXIT_NEVER, /* respawn every worker exiting */
+};
+
+static char *const preforkopts[] = { "pin", "exit", NULL };
+static char *const timeoutopts[] = { "sig", "grace", "pgrp", NULL };
+
+static char *const exitpolicies[] = {
+	[EXIT_ANY]   = "any",
+	[EXIT_ALL]   = "all",
+	[EXIT_NEVER] = "never",
+	NULL,
+};
+
+int         sigign[NSIG];
+const char *sigtrap[NSIG];
+int         prefork_workers; /* 0 if not preforking, -1 for one per CPU */
+
+static const char    *execfile;
+static char         **execargv;
+static struct worker *workers;
+static int            nworkers = 1, running, stopping, result, haveresult;
+static int            prefork_pin, prefork_exit = EXIT_NEVER;
+static struct trap    traps[NSIG];
+static struct source  sigsrc, timersrc, deadlinesrc;
+static sigset_t       oldmask;
+static int            epollfd;
+static double         timeout_after, timeout_grace = TIMEOUT_GRACE; /* seconds of -Z, 0 if unlimited */
+static int            timeout_signal = SIGTERM, timeout_pgrp;
+static int            timedout; /* 1 once timeout_signal is sent, 2 once SIGKILL is */
+
+
+/* parse `[n][,pin][,exit=any|all|never]` of -W */
+void parse_prefork(char *spec) {
+	char *value, *end;
+
+	prefork_workers = -1;
+	if (*spec >= '0' && *spec <= '9') {
+		prefork_workers = strtol(spec, &end, 10);
+		if (prefork_workers == 0)
+			prefork_workers = -1;
+		spec = end;
+		if (*spec == ',')
+			spec++;
+		else if (*spec)
+			goto invalid;
+	}
+
+	while (*spec) {
+		switch (getsubopt(&spec, preforkopts, &value)) {
+			case 0:
+				prefork_pin = 1;
+				break;
+			case 1:
+				for (prefork_exit = 0; exitpolicies[prefork_exit]; prefork_exit++) {
+					if (value && !strcmp(value, exitpolicies[prefork_exit]))
+						break;
+				}
+				if (!exitpolicies[prefork_exit])
+					goto invalid;
+				break;
+			default:
+				goto invalid;
+		}
+	}
+	return;
+
+invalid:
+	fprintf(stderr, "%s: invalid worker specification\n", self);
+	exit(100);
+}
+
+/* parse `seconds[,sig=signal][,grace=seconds][,pgrp]` of -Z */
+void parse_timeout(char *spec) {
+	char *value, *end;
+
+	timeout_after = strtod(spec, &end);
+	if (end == spec || timeout_after <= 0)
+		goto invalid;
+	spec = end;
+	if (*spec == ',')
+		spec++;
+	else if (*spec)
+		goto invalid;
+
+	while (*spec) {
+		switch (getsubopt(&spec, timeoutopts, &value)) {
+			case 0:
+				if (!value || (timeout_signal = signame_to_signum(value)) <= 0)
+					goto invalid;
+				break;
+			case 1:
+				if (!value || (timeout_grace = strtod(value, &end)) < 0 || end == value || *end)
+					goto invalid;
+				break;
+			case 2:
+				timeout_pgrp = 1;
+				break;
+			default:
+				goto invalid;
+		}
+	}
+	return;
+
+invalid:
+	fprintf(stderr, "%s: invalid timeout specification\n", self);
+	exit(100);
+}
+
+/* number of workers of -W, resolving one per CPU we may run on */
+int prefork_count(void) {
+	cpu_set_t set;
+
+	if (prefork_workers >= 0)
+		return prefork_workers;
+	if (sched_getaffinity(0, sizeof(set), &set) == -1)
+		return 1;
+	return CPU_COUNT(&set);
+}
+
+static int sendsignal(struct process *proc, int signo) {
+#ifdef SYS_pidfd_send_signal
+	if (proc->src.fd != -1)
+		return syscall(SYS_pidfd_send_signal, proc->src.fd, signo, NULL, 0);
+#endif
+	return kill(proc->pid, signo);
+}
+
+/* signal the worker, or its process group with -Z ...,pgrp */
+static int sendworker(struct worker *w, int signo) {
+	if (timeout_pgrp)
+		return kill(-w->proc.pid, signo);
+	return sendsignal(&w->proc, signo);
+}
+
+/* arm the timerfd fd to expire once after seconds */
+void settimer(int fd, double seconds) {
+	struct itimerspec timer = { .it_value = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) } };
+
+	/* a zero timer would disarm it */
+	if (timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0)
+		timer.it_value.tv_nsec = 1;
+	if (timerfd_settime(fd, 0, &timer, NULL) == -1)
+		FAIL_ERRNO(102, "unable to arm timerfd");
+}
+
+/* register an event-source at the epoll-instance */
+void supervise_watch(struct source *src, int events) {
+	struct epoll_event ev = { .events = events, .data.ptr = src };
+
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, src->fd, &ev) == -1)
+		FAIL_ERRNO(102, "unable to watch event-source");
+}
+
+static void watch(struct source *src) {
+	supervise_watch(src, EPOLLIN);
+}
+
+/* call fn with the pid of every running worker */
+void supervise_foreach(void (*fn)(pid_t pid)) {
+	for (int i = 0; i < nworkers; i++) {
+		if (!workers[i].proc.exited)
+			fn(workers[i].proc.pid);
+	}
+}
+
+static void unwatch(struct source *src) {
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, src->fd, NULL);
+	close(src->fd);
+	src->fd = -1;
+}
+
+static void track(struct process *proc, pid_t pid, int pidfd, void (*handle)(struct source *src)) {
+	proc->pid        = pid;
+	proc->exited     = 0;
+	proc->src.fd     = pidfd;
+	proc->src.handle = handle;
+	if (pidfd != -1)
+		watch(&proc->src);
+}
+
+/* reap proc, returns 0 if it is still running */
+static int reap(struct process *proc) {
+	siginfo_t info = { 0 };
+
+	if (proc->exited)
+		return 1;
+
+	if (proc->measure) {
+		/* peek first, the io-counters vanish with the zombie */
+		if (waitid(P_PID, proc->pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid == 0)
+			return 0;
+		usage_readio(proc->pid, &proc->io);
+	}
+	if (wait4(proc->pid, &proc->status, WNOHANG, &proc->usage) <= 0)
+		return 0;
+
+	proc->exited = 1;
+	if (proc->src.fd != -1)
+		unwatch(&proc->src);
+	return 1;
+}
+
+/* copy of the environment with pairs in front, replacing variables of the same name */
+static char **envwith(char **pairs, int npairs) {
+	char  **envp;
+	size_t  n = 0, namelen;
+	int     shadowed;
+
+	for (char **env = environ; *env; env++)
+		n++;
+	if ((envp = malloc((n + npairs + 1) * sizeof(*envp))) == NULL)
+		return NULL;
+
+	n = 0;
+	for (int i = 0; i < npairs; i++)
+		envp[n++] = pairs[i];
+	for (char **env = environ; *env; env++) {
+		shadowed = 0;
+		for (int i = 0; i < npairs && !shadowed; i++) {
+			namelen  = strchr(pairs[i], '=') - pairs[i] + 1;
+			shadowed = !strncmp(*env, pairs[i], namelen);
+		}
+		if (!shadowed)
+			envp[n++] = *env;
+	}
+	envp[n] = NULL;
+
+	return envp;
+}
+
+static double elapsed(const struct timespec *since) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static void handle_worker(struct source *src);
+
+static void startworker(int index) {
+	struct worker *w = &workers[index];
+	char           worker_env[32], *pair = worker_env, **envp = environ;
+	cpu_set_t      allowed, set;
+	pid_t          pid;
+	int            pidfd, cpu, nth;
+
+	if (prefork_workers != 0) {
+		snprintf(worker_env, sizeof(worker_env), "ENVMOD_WORKER=%d", index);
+		if ((envp = envwith(&pair, 1)) == NULL)
+			FAIL_ERRNO(102, "unable to allocate memory");
+		listen_worker(index);
+	}
+
+	spawn_setpgid = timeout_pgrp;
+	pid           = spawn(execfile, execargv, envp, &oldmask, &pidfd, 0);
+	track(&w->proc, pid, pidfd, handle_worker);
+	clock_gettime(CLOCK_MONOTONIC, &w->started);
+	w->proc.measure = usage_report != NULL;
+	w->respawn      = 0;
+	running++;
+
+	if (envp != environ)
+		free(envp);
+
+	/* pin to the index'th CPU we may run on */
+	if (prefork_pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0) {
+		nth = index % CPU_COUNT(&allowed);
+		for (cpu = 0; nth > 0 || !CPU_ISSET(cpu, &allowed); cpu++) {
+			if (CPU_ISSET(cpu, &allowed))
+				nth--;
+		}
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(pid, sizeof(set), &set) == -1)
+			FAIL_ERRNO(-1, "unable to pin worker %d", index);
+	}
+}
+
+static void handle_worker(struct source *src) {
+	struct worker    *w     = (struct worker *) src;
+	struct itimerspec timer = { .it_value = { RESPAWN_DELAY, 0 } };
+
+	if (!reap(&w->proc))
+		return;
+
+	running--;
+	if (verbose && prefork_workers != 0)
+		fprintf(stderr, "%s: worker %d exited\n", self, (int) (w - workers));
+	if (w->proc.measure)
+		usage_print(prefork_workers != 0 ? (int) (w - workers) : -1, w->proc.pid, w->proc.status,
+		            elapsed(&w->started), &w->proc.usage, &w->proc.io);
+
+	/* the first worker decides with exit=any, the last one otherwise */
+	if (prefork_exit != EXIT_ANY || !haveresult)
+		result = w->proc.status;
+	haveresult = 1;
+
+	if (stopping)
+		return;
+
+	switch (prefork_exit) {
+		case EXIT_ANY:
+			stopping = 1;
+			for (int i = 0; i < nworkers; i++) {
+				if (!workers[i].proc.exited)
+					sendsignal(&workers[i].proc, SIGTERM);
+			}
+			break;
+		case EXIT_ALL:
+			break;
+		case EXIT_NEVER:
+			if (elapsed(&w->started) >= RESPAWN_DELAY) {
+				startworker(w - workers);
+			} else {
+				/* crashing right away, don't spin */
+				w->respawn = 1;
+				timerfd_settime(timersrc.fd, 0, &timer, NULL);
+			}
+			break;
+	}
+}
+
+static void handle_timer(struct source *src) {
+	uint64_t expirations;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) <= 0)
+		return;
+
+	for (int i = 0; i < nworkers && !stopping; i++) {
+		if (workers[i].respawn)
+			startworker(i);
+	}
+}
+
+/* the wall-clock timeout of -Z expired, or its grace period after that */
+static void handle_deadline(struct source *src) {
+	uint64_t expirations;
+	int      signo;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) <= 0)
+		return;
+
+	signo = timedout++ ? SIGKILL : timeout_signal;
+	if (verbose)
+		fprintf(stderr, "%s: timed out, sending %s\n", self, signum_to_signame(signo));
+	if (signo != SIGKILL)
+		settimer(src->fd, timeout_grace);
+
+	/* timed out workers are not respawned */
+	stopping = 1;
+	for (int i = 0; i < nworkers; i++) {
+		if (!workers[i].proc.exited)
+			sendworker(&workers[i], signo);
+	}
+}
+
+/* workers waiting for the respawn-timer */
+static int respawning(void) {
+	for (int i = 0; i < nworkers && !stopping; i++) {
+		if (workers[i].respawn)
+			return 1;
+	}
+	return 0;
+}
+
+static void runtrap(int signo);
+
+static void handle_trap(struct source *src) {
+	struct trap *trap = (struct trap *) src;
+
+	if (!reap(&trap->proc))
+		return;
+
+	trap->proc.pid = 0;
+	if (trap->pending) {
+		trap->pending = 0;
+		runtrap(trap - traps);
+	}
+}
+
+static void runtrap(int signo) {
+	char        signo_env[20], signame_env[32];
+	char       *argv[4], **envp, *pairs[2] = { signo_env, signame_env };
+	const char *shell = shellname();
+	pid_t       pid;
+	int         pidfd;
+
+	if (traps[signo].proc.pid != 0) {
+		traps[signo].pending = 1;
+		return;
+	}
+
+	snprintf(signo_env, sizeof(signo_env), "signo=%d", signo);
+	snprintf(signame_env, sizeof(signame_env), "signame=%s", signum_to_signame(signo));
+	if ((envp = envwith(pairs, 2)) == NULL) {
+		FAIL_ERRNO(-1, "unable to allocate memory");
+		return;
+	}
+
+	argv[0] = (char *) shell;
+	argv[1] = "-c";
+	argv[2] = (char *) sigtrap[signo];
+	argv[3] = NULL;
+
+	/* never stall the event-loop for long on a handler */
+	spawn_fds = NULL;
+	if ((pid = spawn(shell, argv, envp, &oldmask, &pidfd, SPAWN_TRAP_TRIES)) != -1)
+		track(&traps[signo].proc, pid, pidfd, handle_trap);
+	free(envp);
+}
+
+/* without pidfds, children are reaped on SIGCHLD */
+static void reapall(void) {
+	for (int i = 0; i < nworkers; i++) {
+		if (!workers[i].proc.exited && workers[i].proc.src.fd == -1)
+			handle_worker(&workers[i].proc.src);
+	}
+	for (int i = 0; i < NSIG; i++) {
+		if (traps[i].proc.pid != 0)
+			handle_trap(&traps[i].proc.src);
+	}
+}
+
+static void handle_signals(struct source *src) {
+	struct signalfd_siginfo info[MAXSIGINFO];
+	ssize_t                 n;
+	int                     signo;
+
+	while ((n = read(src->fd, info, sizeof(info))) > 0) {
+		for (size_t i = 0; i < n / sizeof(*info); i++) {
+			signo = info[i].ssi_signo;
+
+			if (signo == SIGCHLD) {
+				reapall();
+				continue;
+			}
+
+			if (sigtrap[signo])
+				runtrap(signo);
+
+			if (sigign[signo])
+				continue;
+
+			/* workers stopped on purpose are not respawned */
+			if (signo == SIGTERM || signo == SIGINT || signo == SIGQUIT)
+				stopping = 1;
+			for (int j = 0; j < nworkers; j++) {
+				if (!workers[j].proc.exited)
+					sendsignal(&workers[j].proc, signo);
+			}
+		}
+	}
+}
+
+int supervise(const char *exec, char **argv) {
+	struct epoll_event events[MAXEVENTS];
+	struct timespec    started;
+	sigset_t           mask;
+	int                n;
+
+	execfile = exec;
+	execargv = argv;
+	if (prefork_workers != 0 && (nworkers = prefork_count()) < 1)
+		nworkers = 1;
+	if (prefork_workers == 0)
+		prefork_exit = EXIT_ANY;
+
+	if ((workers = calloc(nworkers, sizeof(*workers))) == NULL)
+		FAIL_ERRNO(102, "unable to allocate memory");
+
+	if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		FAIL_ERRNO(102, "unable to create epoll-instance");
+
+	/* every signal is received through the signalfd, children get the original mask back */
+	sigfillset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, &oldmask);
+	if ((sigsrc.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+		FAIL_ERRNO(102, "unable to create signalfd");
+	sigsrc.handle = handle_signals;
+	watch(&sigsrc);
+
+	if (prefork_exit == EXIT_NEVER) {
+		if ((timersrc.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+			FAIL_ERRNO(102, "unable to create timerfd");
+		timersrc.handle = handle_timer;
+		watch(&timersrc);
+	}
+
+	if (timeout_after > 0) {
+		if ((deadlinesrc.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+			FAIL_ERRNO(102, "unable to create timerfd");
+		deadlinesrc.handle = handle_deadline;
+		watch(&deadlinesrc);
+	}
+
+	usage_open();
+	psi_start();
+	logdir_start();
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	if (timeout_after > 0)
+		settimer(deadlinesrc.fd, timeout_after);
+	for (int i = 0; i < nworkers; i++)
+		startworker(i);
+
+	while (running > 0 || respawning()) {
+		if ((n = epoll_wait(epollfd, events, MAXEVENTS, -1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			FAIL_ERRNO(102, "unable to wait for events");
+		}
+		for (int i = 0; i < n; i++) {
+			struct source *src = events[i].data.ptr;
+			src->handle(src);
+		}
+	}
+
+	logdir_flush();
+	psi_stop();
+
+	if (timedout) {
+		/* members of the process group may outlive the worker, they don't get another grace period */
+		for (int i = 0; i < nworkers && timeout_pgrp; i++)
+			kill(-workers[i].proc.pid, SIGKILL);
+		fprintf(stderr, "%s: timed out after %gs, child ran for %.3fs\n", self, timeout_after, elapsed(&started));
+		return 122;
+	}
+
+	if (WIFEXITED(result)) {
+		if (verbose)
+			fprintf(stderr, "%s: child exited %d\n", self, WEXITSTATUS(result));
+		return WEXITSTATUS(result);
+	}
+
+	if (WIFSIGNALED(result)) {
+		fprintf(stderr, "%s: child terminated using %s\n", self, signum_to_signame(WTERMSIG(result)));
+		return 120;
+	}
+
+	fprintf(stderr, "%s: child terminated\n", self);
+	return 121;
+}
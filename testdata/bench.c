@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pwd.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARGS_MAX     128
+#define ENVIRON_MAX  1200
+#define KEEP_COUNT   32
+#define SCENARIO_MAX 64
+#define WARMUP       10
+
+#define FAIL(...) (fprintf(stderr, "bench: " __VA_ARGS__), fprintf(stderr, ": %s\n", strerror(errno)), exit(1))
+
+
+struct scenario {
+	char    name[32];
+	char   *argv[ARGS_MAX];
+	int     argc;
+	char  **envp;
+	double  p50, p90, p99, mean, min;
+};
+
+static const int sizes[] = { 10, 100, 1000, 10000 };
+
+extern char **environ;
+
+static const char     *envmod     = "./envmod";
+static const char     *printhello = "testdata/printhello";
+static int             iterations = 200;
+static struct scenario scenarios[SCENARIO_MAX];
+static int             nscenarios;
+static char            scratch[] = "/tmp/envmod-bench.XXXXXX";
+static char           *bigenv[ENVIRON_MAX];
+
+
+static void usage(void) {
+	fprintf(stderr, "usage: bench [-n iterations] [-o results] [-c baseline] [-t percent] [-s filter] [envmod]\n");
+	exit(1);
+}
+
+static struct scenario *scenario(const char *name) {
+	struct scenario *sc = &scenarios[nscenarios++];
+
+	snprintf(sc->name, sizeof(sc->name), "%s", name);
+	sc->envp = environ;
+	return sc;
+}
+
+static void arg(struct scenario *sc, const char *value) {
+	sc->argv[sc->argc++] = strdup(value);
+}
+
+/* an envmod-scenario, its options are added by the caller, printhello by finish() */
+static struct scenario *envmodrun(const char *name) {
+	struct scenario *sc = scenario(name);
+
+	arg(sc, envmod);
+	return sc;
+}
+
+static void finish(struct scenario *sc) {
+	arg(sc, printhello);
+	sc->argv[sc->argc] = NULL;
+}
+
+static void writefile(const char *path, const char *content) {
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		FAIL("unable to create `%s`", path);
+	if (write(fd, content, strlen(content)) == -1)
+		FAIL("unable to write `%s`", path);
+	close(fd);
+}
+
+static void makeenvdir(int size) {
+	char path[256], value[64];
+
+	snprintf(path, sizeof(path), "%s/envdir%d", scratch, size);
+	if (mkdir(path, 0755) == -1)
+		FAIL("unable to create `%s`", path);
+	for (int i = 0; i < size; i++) {
+		snprintf(path, sizeof(path), "%s/envdir%d/VAR_%d", scratch, size, i);
+		snprintf(value, sizeof(value), "value-of-variable-%d\n", i);
+		writefile(path, value);
+	}
+}
+
+static void makeenvfile(int size) {
+	char  path[256];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/envfile%d", scratch, size);
+	if ((fp = fopen(path, "w")) == NULL)
+		FAIL("unable to create `%s`", path);
+	for (int i = 0; i < size; i++)
+		fprintf(fp, "VAR_%d=value-of-variable-%d\n", i, i);
+	fclose(fp);
+}
+
+static void setup(void) {
+	struct scenario *sc;
+	struct passwd   *pw;
+	char             path[256], name[32];
+	int              n = 0;
+
+	if (mkdtemp(scratch) == NULL)
+		FAIL("unable to create scratch directory");
+
+	sc = scenario("direct");
+	finish(sc);
+
+	sc = envmodrun("envmod");
+	finish(sc);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		makeenvdir(sizes[i]);
+		snprintf(path, sizeof(path), "%s/envdir%d", scratch, sizes[i]);
+		snprintf(name, sizeof(name), "envdir-%d", sizes[i]);
+		sc = envmodrun(name);
+		arg(sc, "-e");
+		arg(sc, path);
+		finish(sc);
+	}
+
+	/* the largest envdir once more with its cache, the first run builds it */
+	snprintf(path, sizeof(path), "%s/envdir%d", scratch, sizes[sizeof(sizes) / sizeof(*sizes) - 1]);
+	snprintf(name, sizeof(name), "envdir-cache-%d", sizes[sizeof(sizes) / sizeof(*sizes) - 1]);
+	sc = envmodrun(name);
+	arg(sc, "-B");
+	arg(sc, path);
+	finish(sc);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		makeenvfile(sizes[i]);
+		snprintf(path, sizeof(path), "%s/envfile%d", scratch, sizes[i]);
+		snprintf(name, sizeof(name), "envfile-%d", sizes[i]);
+		sc = envmodrun(name);
+		arg(sc, "-E");
+		arg(sc, path);
+		finish(sc);
+	}
+
+	/* filter a large environment down to a keep-list */
+	for (char **env = environ; *env && n < ENVIRON_MAX - KEEP_COUNT - 1; env++)
+		bigenv[n++] = *env;
+	for (int i = 0; n < ENVIRON_MAX - 1; i++) {
+		snprintf(path, sizeof(path), "BENCH_%d=value-of-variable-%d", i, i);
+		bigenv[n++] = strdup(path);
+	}
+	sc       = envmodrun("keep-32");
+	sc->envp = bigenv;
+	arg(sc, "-x");
+	for (int i = 0; i < KEEP_COUNT; i++) {
+		snprintf(name, sizeof(name), "BENCH_%d", i * 10);
+		arg(sc, "-k");
+		arg(sc, name);
+	}
+	finish(sc);
+
+	/* -U does the same lookup as -u, but does not require privileges */
+	if ((pw = getpwuid(getuid())) != NULL) {
+		sc = envmodrun("user-nss");
+		arg(sc, "-U");
+		arg(sc, pw->pw_name);
+		finish(sc);
+
+		sc = envmodrun("user-files");
+		arg(sc, "-N");
+		arg(sc, "-U");
+		arg(sc, pw->pw_name);
+		finish(sc);
+	}
+
+	sc = envmodrun("fork");
+	arg(sc, "-F");
+	finish(sc);
+}
+
+static int unlinkentry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	(void) st, (void) flag, (void) ftw;
+	return remove(path);
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* launch the scenario once, returns the wall-clock time until it is reaped in µs */
+static double launch(struct scenario *sc, posix_spawn_file_actions_t *actions) {
+	double start;
+	pid_t  pid;
+	int    status, err;
+
+	start = now();
+	if ((err = posix_spawn(&pid, sc->argv[0], actions, NULL, sc->argv, sc->envp)) != 0) {
+		errno = err;
+		FAIL("unable to spawn `%s`", sc->argv[0]);
+	}
+	if (waitpid(pid, &status, 0) == -1)
+		FAIL("unable to wait");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "bench: scenario %s failed with status %d\n", sc->name, status);
+		exit(1);
+	}
+	return now() - start;
+}
+
+static int compare(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+	return sorted[(int) ((n - 1) * p + 0.5)];
+}
+
+static void run(struct scenario *sc, posix_spawn_file_actions_t *actions) {
+	double *samples, sum = 0;
+
+	if ((samples = malloc(iterations * sizeof(double))) == NULL)
+		FAIL("unable to allocate memory");
+
+	for (int i = 0; i < WARMUP; i++)
+		launch(sc, actions);
+	for (int i = 0; i < iterations; i++) {
+		samples[i] = launch(sc, actions);
+		sum += samples[i];
+	}
+	qsort(samples, iterations, sizeof(double), compare);
+
+	sc->min  = samples[0];
+	sc->p50  = percentile(samples, iterations, 0.50);
+	sc->p90  = percentile(samples, iterations, 0.90);
+	sc->p99  = percentile(samples, iterations, 0.99);
+	sc->mean = sum / iterations;
+	free(samples);
+}
+
+/* compare the median against the same scenario of a baseline written by -o, returns 1 on regression */
+static int regressed(FILE *baseline, struct scenario *sc, double threshold, char *delta, size_t size) {
+	char   line[256], name[32];
+	double p50;
+
+	snprintf(delta, size, "-");
+	if (baseline == NULL)
+		return 0;
+
+	rewind(baseline);
+	while (fgets(line, sizeof(line), baseline)) {
+		if (sscanf(line, "%31s %lf", name, &p50) != 2 || strcmp(name, sc->name) || p50 <= 0)
+			continue;
+		snprintf(delta, size, "%+.1f%%", (sc->p50 - p50) / p50 * 100);
+		return (sc->p50 - p50) / p50 * 100 > threshold;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	posix_spawn_file_actions_t actions;
+	const char                *output = NULL, *filter = NULL;
+	FILE                      *baseline = NULL, *results = NULL;
+	double                     threshold = 10;
+	char                       delta[16];
+	int                        opt, regressions = 0;
+
+	while ((opt = getopt(argc, argv, "n:o:c:t:s:")) != -1) {
+		switch (opt) {
+			case 'n':
+				if ((iterations = atoi(optarg)) <= 0)
+					usage();
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'c':
+				if ((baseline = fopen(optarg, "r")) == NULL)
+					FAIL("unable to open baseline `%s`", optarg);
+				break;
+			case 't':
+				threshold = atof(optarg);
+				break;
+			case 's':
+				filter = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind < argc)
+		envmod = argv[optind++];
+	if (optind < argc)
+		usage();
+
+	if (access(envmod, X_OK) == -1)
+		FAIL("unable to execute `%s`", envmod);
+	if (access(printhello, X_OK) == -1)
+		FAIL("unable to execute `%s`", printhello);
+
+	setup();
+
+	/* the output of printhello is not part of the measurement */
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+	if (output && (results = fopen(output, "w")) == NULL)
+		FAIL("unable to create `%s`", output);
+
+	printf("%-18s %10s %10s %10s %10s %10s %9s\n", "scenario", "min", "p50", "p90", "p99", "mean", "vs base");
+	for (int i = 0; i < nscenarios; i++) {
+		struct scenario *sc = &scenarios[i];
+
+		if (filter && !strstr(sc->name, filter))
+			continue;
+
+		run(sc, &actions);
+		if (regressed(baseline, sc, threshold, delta, sizeof(delta))) {
+			regressions++;
+			strcat(delta, " !");
+		}
+		printf("%-18s %8.1fus %8.1fus %8.1fus %8.1fus %8.1fus %9s\n", sc->name, sc->min, sc->p50, sc->p90, sc->p99,
+		       sc->mean, delta);
+		fflush(stdout);
+
+		if (results)
+			fprintf(results, "%s\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n", sc->name, sc->p50, sc->p90, sc->p99, sc->mean,
+			        sc->min);
+	}
+
+	if (results)
+		fclose(results);
+	if (baseline)
+		fclose(baseline);
+	posix_spawn_file_actions_destroy(&actions);
+	nftw(scratch, unlinkentry, 16, FTW_DEPTH | FTW_PHYS);
+
+	if (regressions > 0) {
+		fprintf(stderr, "bench: %d scenario(s) regressed by more than %.1f%% at the median\n", regressions, threshold);
+		return 2;
+	}
+	return 0;
+}
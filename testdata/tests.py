@@ -1,10 +1,15 @@
 import subprocess
 import os
+import json
 import shutil
 import string
 import random
+import socket
 import tempfile
+import time
 
+# e.g. ENVMOD=./envmod-static to test the static build
+ENVMOD = os.getenv("ENVMOD", "./envmod")
 
 def randomword(length):
    letters = string.ascii_letters + string.digits
@@ -13,7 +18,7 @@ def randomword(length):
 def run(*args, shell=None, envmod=True, root=False, env=None):
     argv = list(args)
     if envmod:
-        argv = ["./envmod"] + argv
+        argv = [ENVMOD] + argv
     if shell is not None:
         argv += [ 'sh', '-c', shell ]
     result = subprocess.run(
@@ -55,7 +60,48 @@ def test_lock():
 def test_flock():
     with tempfile.TemporaryDirectory() as tmpdirname:
         lockfile = tmpdirname + "/lock"
-        assert run("flock", lockfile, "./envmod", "-l", lockfile, "true", envmod=False) == "1!unable to lock: Resource temporarily unavailable"
+        assert run("flock", lockfile, ENVMOD, "-l", lockfile, "true", envmod=False) == "1!unable to lock: Resource temporarily unavailable"
+
+def test_jobserver():
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        with open(tmpdirname + "/Makefile", "w") as f:
+            f.write("all: a b c\na b c:\n\t@echo $(MAKEFLAGS) | grep -q jobserver && echo $@\n")
+        assert sorted(run("-y", "2,pipe", "make", "-s", "-C", tmpdirname).split()) == ["a", "b", "c"]
+    assert run("-y", "2", shell=f"({ENVMOD} -y auto sh -c 'sleep 0.3; echo first') & sleep 0.1; {ENVMOD} -y auto echo second; wait") == "first\nsecond"
+    assert run("-y", "1", shell="echo $MAKEFLAGS").startswith("-j1 --jobserver-auth=fifo:")
+    # the token of a passed pipe is taken and given back
+    readfd, writefd = os.pipe()
+    os.write(writefd, b"+")
+    env = {"PATH": os.getenv("PATH"), "MAKEFLAGS": f"-j2 --jobserver-auth={readfd},{writefd}"}
+    result = subprocess.run([ENVMOD, "-y", "auto", "-v", "true"], env=env, pass_fds=(readfd, writefd), stderr=subprocess.PIPE, text=True)
+    assert result.returncode == 0 and "jobserver" not in result.stderr
+    assert os.read(readfd, 1) == b"+"
+    os.close(readfd)
+    os.close(writefd)
+    # not passed, the fd of MAKEFLAGS is taken by the lock of -l
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        env["MAKEFLAGS"] = "-j2 --jobserver-auth=3,3"
+        assert run("-y", "auto", "-v", "-l", tmpdirname + "/lock", "true", env=env).split("\n")[1] == "envmod: jobserver is not passed to this command, running without a token"
+
+def test_lock_timeout():
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        lockfile = tmpdirname + "/lock"
+        assert run("flock", lockfile, ENVMOD, "-w", "0.2", "-L", lockfile, "true", envmod=False).startswith("103!envmod: timed out waiting for lock")
+        assert run("flock", "-s", lockfile, ENVMOD, "-w", "0.2", "-L", lockfile, "true", envmod=False).startswith("103!")
+
+def test_lock_slots():
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        lockfile = tmpdirname + "/lock"
+        holder = subprocess.Popen([ENVMOD, "-L", lockfile, "-q", "2", "sh", "-c", "echo $ENVMOD_SLOT; exec sleep 5"], stdout=subprocess.PIPE, text=True)
+        try:
+            assert holder.stdout.readline().strip() == "0"
+            assert run("-L", lockfile, "-q", "2", shell="echo $ENVMOD_SLOT") == "1"
+            assert run("-l", lockfile, "-q", "1", "true") == "101!envmod: unable to lock file: Resource temporarily unavailable"
+            assert run("-L", lockfile, "-q", "1", "-w", "0.2", "true").startswith("103!envmod: timed out waiting for lock")
+            assert run("-l", lockfile, "-q", "1", "-w", "0.2", "true").startswith("103!envmod: timed out waiting for lock")
+        finally:
+            holder.kill()
+            holder.wait()
 
 def test_closestdin():
     assert run("-0", "cat") == "1!cat: -: Bad file descriptor\ncat: closing standard input: Bad file descriptor"
@@ -71,15 +117,221 @@ def test_closestderr():
     # no output, stderr is closed
     assert run("-2", shell="echo hello 1>&2") == "2!"
 
+def test_trap():
+    assert run("-T", "USR1", "echo trapped $signame", "-i", "USR1", shell="kill -USR1 $PPID; sleep 0.5; echo done") == "trapped USR1\ndone"
+
+def test_fork_signal():
+    assert run("-F", shell="kill -TERM $PPID; sleep 1") == "120!envmod: child terminated using TERM"
+
+def test_timeout():
+    assert run("-Z", "0.2", "sleep", "5").startswith("122!envmod: timed out after 0.2s, child ran for 0.2")
+    assert run("-Z", "0.2,sig=INT,grace=0.2", shell="trap 'echo ignored $$' INT; while :; do sleep 0.05; done").startswith("122!ignored")
+    pid, pgid = run("-Z", "0.2,pgrp", shell="echo $$ $(cut -d' ' -f5 /proc/$$/stat); sleep 5").removeprefix("122!").split()[:2]
+    assert pid == pgid
+    assert run("-Z", "0", "true") == "100!envmod: invalid timeout specification"
+
+def pressure_writable():
+    # registering a trigger needs a PSI-enabled kernel and write access to /proc/pressure
+    try:
+        with open("/proc/pressure/cpu", "r+b", buffering=0) as f:
+            f.write(b"some 500000 2000000\0")
+        return True
+    except OSError:
+        return False
+
+def test_pressure():
+    assert run("-Y", "cpu,action=freeze", "true") == "100!envmod: -Y action=freeze requires a cgroup (-g)"
+    assert run("-Y", "cpu,action=nice:100", "true") == "100!envmod: invalid pressure action `100`"
+
+if pressure_writable():
+    def test_pressure_throttle():
+        # a single hog competing with the child on one CPU stalls it for about half of the time,
+        # unprivileged triggers are only evaluated every 2 seconds
+        hog = subprocess.Popen([ENVMOD, "-A", "0", "sh", "-c", "while :; do :; done"])
+        try:
+            with tempfile.TemporaryDirectory() as tmpdirname:
+                fakecgroup(tmpdirname, "cgroup.subtree_control")
+                fakecgroup(tmpdirname + "/svc", "cgroup.procs", "cgroup.freeze")
+                output = run("-A", "0", "-g", tmpdirname + "/svc", "-Y", "cpu=5,hold=0.5,action=freeze", shell="end=$(($(date +%s) + 4)); while [ $(date +%s) -lt $end ]; do :; done")
+                assert output.startswith("envmod: cpu pressure above 5%, throttling child\n")
+                assert open(tmpdirname + "/svc/cgroup.freeze").read() == "0"
+        finally:
+            hog.kill()
+            hog.wait()
+        if os.geteuid() == 0:
+            assert run("-u", "nobody:nogroup", "-Y", "cpu,action=nice", "true") == "100!envmod: -Y action=nice cannot be undone without privileges, e.g. after -u"
+
+def test_logdir():
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        logdir = tmpdirname + "/log"
+        assert run("-O", logdir + ",size=20,keep=1", shell="for i in 1 2 3 4; do echo line $i; echo err $i >&2; sleep 0.05; done") == ""
+        rotated = [name for name in os.listdir(logdir) if name.startswith("@")]
+        assert len(rotated) == 1 and open(logdir + "/" + rotated[0]).read() == "err 2\nline 3\nerr 3\nline 4\n"
+        assert open(logdir + "/current").read() == "err 4\n"
+        assert run("-O", tmpdirname + "/stamped,timestamp", shell="echo a; printf b; sleep 0.05; echo c") == ""
+        lines = open(tmpdirname + "/stamped/current").read().splitlines()
+        assert [line.split(" ", 1)[1] for line in lines] == ["a", "bc"] and lines[0].endswith("Z a")
+
+def test_jobs():
+    with tempfile.NamedTemporaryFile("w") as jobfile:
+        jobfile.write("sleep 0.3\n\ntrue\nfalse\n")
+        jobfile.flush()
+        assert run("-j", "2,ordered", "-J", jobfile.name) == "123!envmod: job 1 exited 0: sleep 0.3\nenvmod: job 2 exited 0: true\nenvmod: job 3 exited 1: false"
+        assert run("-j", "1", "-J", jobfile.name, "-S", "FOO=bar", "echo $FOO") == "bar sleep 0.3\nenvmod: job 1 exited 0: sleep 0.3\nbar true\nenvmod: job 2 exited 0: true\nbar false\nenvmod: job 3 exited 0: false"
+        for opt in (["-W", "2"], ["-z", "-"], ["-Y", "cpu"], ["-Z", "1"], ["-O", "log"], ["-F"], ["-i", "INT"], ["-T", "TERM", "true"], ["-b", "name"]):
+            assert run("-J", jobfile.name, *opt).startswith(f"100!envmod: option {opt[0]} cannot be used with -j\nusage:")
+
+def fakecgroup(path, *files):
+    # a cgroupfs creates the files of a cgroup by itself, envmod never does
+    os.makedirs(path, exist_ok=True)
+    for name in files:
+        open(path + "/" + name, "w").close()
+
+def test_cgroup():
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        fakecgroup(tmpdirname, "cgroup.subtree_control")
+        fakecgroup(tmpdirname + "/svc", "cgroup.procs", "memory.max", "pids.max")
+        assert run("-g", tmpdirname + "/svc", "-R", "memory.max=64M", "-R", "pids.max=10", shell="echo $$") == open(tmpdirname + "/svc/cgroup.procs").read()
+        assert open(tmpdirname + "/svc/memory.max").read() == "64M"
+        assert open(tmpdirname + "/cgroup.subtree_control").read() == "+memory+pids"
+        assert run("-g", tmpdirname + "/svc", "-R", "memroy.max=64M", "true") == f"101!envmod: unable to set cgroup `memroy.max=64M`: No such file or directory"
+    assert run(*["-R", "pids.max=10"] * 17, "true") == "100!envmod: option -R can be given at most 16 times"
+
+def test_placement():
+    assert run("-A", "0", "grep", "Cpus_allowed_list", "/proc/self/status") == "Cpus_allowed_list:\t0"
+    assert run("-A", "near:lo", "-H", "bind:0", "grep", "-m1", "-o", "bind:0", "/proc/self/numa_maps") == "bind:0"
+    assert run("-H", "bind", "true").startswith("100!")
+
+def test_schedule():
+    assert run("-Q", "batch,slack=5000", shell="cut -d' ' -f41 /proc/self/stat; cat /proc/self/timerslack_ns") == "3\n5000"
+    assert run("-Q", "io=bogus", "true") == "100!envmod: invalid scheduling io-class `bogus`"
+    assert run("-F", "-Q", "runtime=10000000,period=100000000", "true") == "100!envmod: policy deadline cannot be used with -j or options implying -F"
+
+def test_memory():
+    assert run("-X", "thp=never,oom=500", shell="grep THP_enabled /proc/self/status; cat /proc/self/oom_score_adj") == "THP_enabled:\t0\n500"
+    assert run("-X", "oom=2000", "true") == "100!envmod: invalid memory oom-score `2000`"
+
+def test_sockets():
+    script = "import os, socket; s = socket.socket(fileno=3); print(os.environ['LISTEN_FDS'], os.environ['LISTEN_FDNAMES'], os.environ['LISTEN_PID'] == str(os.getpid()), s.getsockname())"
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        path = tmpdirname + "/sock"
+        assert run("-I", "unix:" + path + ",name=ctl", "python3", "-c", script) == f"1 ctl True {path}"
+        assert run("-F", "-I", "tcp:127.0.0.1:0,reuseport", "-I", "udp:[::1]:0", "python3", "-c", script).startswith("2 unknown:unknown True ('127.0.0.1',")
+        # more sockets than fit below the fds envmod keeps for itself, like the pipe of -O
+        many = [arg for i in range(12) for arg in ("-I", f"unix:{tmpdirname}/many{i}")]
+        assert run("-O", tmpdirname + "/log", *many, shell="echo $LISTEN_FDS") == ""
+        assert open(tmpdirname + "/log/current").read() == "12\n"
+    assert run(*["-I", "tcp:127.0.0.1:0"] * 17, "true") == "100!envmod: option -I can be given at most 16 times"
+
+def test_prefork():
+    assert sorted(run("-W", "3,exit=all", shell="echo $ENVMOD_WORKER").split()) == ["0", "1", "2"]
+    assert run("-W", "3,exit=any", shell="[ $ENVMOD_WORKER = 1 ] && exit 7; exec sleep 5") == "7!"
+
+def test_prefork_unix():
+    # every worker answers a single connection with its index
+    script = "import os, socket; c, _ = socket.socket(fileno=3).accept(); c.sendall(os.environ['ENVMOD_WORKER'].encode())"
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        path = tmpdirname + "/sock"
+        workers = subprocess.Popen([ENVMOD, "-W", "2,exit=all", "-I", "unix:" + path + ",reuseport", "python3", "-c", script])
+        try:
+            for _ in range(100):
+                if os.path.exists(path):
+                    break
+                time.sleep(0.01)
+            answers = []
+            for _ in range(2):
+                with socket.socket(socket.AF_UNIX) as client:
+                    client.settimeout(5)
+                    client.connect(path)
+                    answers.append(client.recv(16).decode())
+            assert sorted(answers) == ["0", "1"]
+            assert workers.wait(timeout=5) == 0
+        finally:
+            workers.kill()
+            workers.wait()
+
+def test_usage_report():
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        report = tmpdirname + "/usage.json"
+        assert run("-z", "json:" + report, shell="head -c 100000 /dev/zero > /dev/null") == ""
+        with open(report) as f:
+            usage = json.loads(f.read())
+        assert usage["exit"] == 0 and usage["wchar"] >= 100000 and usage["maxrss_kb"] > 0
+    assert run("-z", "-", "true").startswith("envmod: child ")
+
+def test_trace():
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        trace = tmpdirname + "/trace.json"
+        assert run("-D", trace, "-e", "testdata/envdir", "true") == ""
+        with open(trace) as f:
+            phases = [ phase["name"] for phase in json.loads(f.read())["phases"] ]
+        assert phases[0] == "args" and "envdir" in phases and phases[-1] == "exec"
+        assert run("-D", "chrome:" + trace, "-F", "true") == ""
+        with open(trace) as f:
+            events = json.loads(f.read())["traceEvents"]
+        assert all(event["ph"] == "X" for event in events) and events[-1]["name"] == "spawn"
+
+def test_profile():
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        shutil.copytree("testdata/envdir", tmpdirname + "/envdir")
+        with open(tmpdirname + "/envfile", "w") as f:
+            f.write("value=one\n")
+        with open(tmpdirname + "/profile", "w") as f:
+            f.write("# sample profile\n-e " + tmpdirname + "/envdir\n-E '" + tmpdirname + "/envfile'\n-C /\n")
+        assert run("-@", tmpdirname + "/profile", shell="echo $hello $value $PWD") == "world one /"
+        assert os.path.exists(tmpdirname + "/profile.compiled")
+        assert run("-@", tmpdirname + "/profile", shell="echo $hello $value $PWD") == "world one /"
+        with open(tmpdirname + "/envfile", "w") as f:
+            f.write("value=two\n")
+        assert run("-@", tmpdirname + "/profile", shell="echo $hello $value") == "world two"
+        assert os.stat(tmpdirname + "/profile.compiled").st_mode & 0o777 == 0o600
+        # same size and mtime, only the ctime tells the change
+        st = os.stat(tmpdirname + "/envfile")
+        with open(tmpdirname + "/envfile", "w") as f:
+            f.write("value=tri\n")
+        os.utime(tmpdirname + "/envfile", ns=(st.st_atime_ns, st.st_mtime_ns))
+        assert run("-@", tmpdirname + "/profile", shell="echo $hello $value") == "world tri"
+        # an entry that cannot be read is not compiled in
+        os.remove(tmpdirname + "/profile.compiled")
+        os.mkdir(tmpdirname + "/envdir/broken")
+        assert run("-@", tmpdirname + "/profile", shell="echo $hello $value").endswith("world tri")
+        assert not os.path.exists(tmpdirname + "/profile.compiled")
+        with open(tmpdirname + "/long", "w") as f:
+            f.write("-C / " * 20000)
+        assert run("-@", tmpdirname + "/long", "true") == "100!envmod: profile `" + tmpdirname + "/long` is too long, at most 65536 bytes"
+
 def test_setsid():
     assert run("-P", "python3", "-c", "import os; print(os.getsid(0))") != os.getsid(0)
 
 def test_envdir():
     assert run("-e", "testdata/envdir", shell="echo $hello $foo $HOME") == "world bar"
 
+def test_envdir_batches():
+    # large envdirs are read in batches through io_uring where available
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        for i in range(150):
+            with open(f"{tmpdirname}/VAR{i}", "w") as f:
+                f.write(str(i) if i % 10 else "")
+        assert run("-e", tmpdirname, shell="echo $VAR1 $VAR64 $VAR149 ${VAR10-unset}") == "1 64 149 unset"
+
+def test_envdir_cache():
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        shutil.copytree("testdata/envdir", tmpdirname, dirs_exist_ok=True)
+        assert run("-B", tmpdirname, shell="echo $hello $foo $HOME") == "world bar"
+        assert os.path.exists(tmpdirname + "/.envmod.cache")
+        with open(tmpdirname + "/foo", "w") as f:
+            f.write("baz")
+        assert run("-e", tmpdirname, shell="echo $hello $foo $HOME") == "world baz"
+
 def test_envfile():
     assert run("-E", "testdata/envfile.txt", shell="echo $hello $foo $HOME") == "world bar"
 
+def test_envfile_strip():
+    with tempfile.NamedTemporaryFile("w") as envfile:
+        envfile.write("  hello=world \r\nfoo=\n\nnoequal\nlast=line")
+        envfile.flush()
+        assert run("-E", envfile.name, "foo=bar", shell="echo \"[$hello][${foo-unset}][$last]\"") == "[world][unset][line]"
+
 def test_keepenv():
     assert run("-x", "-k", "PATH", shell="echo $HOME $PATH") == os.getenv("PATH")
 
@@ -94,6 +346,29 @@ if os.geteuid() == 0:
     def test_uidgid():
         assert run("-u", "nobody:nogroup", shell="whoami; groups") == "nobody\nnogroup"
 
+    def test_uidgid_files():
+        assert run("-N", "-u", "nobody:nogroup", shell="whoami; groups") == "nobody\nnogroup"
+
+    def test_profile_users():
+        # only users looked up in the files are compiled, NSS may change without touching them
+        with tempfile.TemporaryDirectory() as tmpdirname:
+            # the compiled profile is written by the user of -u
+            os.chmod(tmpdirname, 0o777)
+            for name, options, compiled in (("nss", "-u nobody:nogroup", b"nobody:nogroup"), ("files", "-N -u nobody:nogroup", b":65534:65534")):
+                with open(tmpdirname + "/" + name, "w") as f:
+                    f.write(options)
+                assert run("-@", tmpdirname + "/" + name, shell="whoami") == "nobody"
+                assert compiled in open(tmpdirname + "/" + name + ".compiled", "rb").read()
+                assert run("-@", tmpdirname + "/" + name, shell="whoami") == "nobody"
+
+    def test_uidgid_cache():
+        with tempfile.TemporaryDirectory() as tmpdirname:
+            cache = tmpdirname + "/cache"
+            assert run("-K", cache, "60", "-U", "nobody:nogroup", shell="echo $UID") == "65534"
+            with open(cache) as f:
+                assert f.read().startswith("u nobody ")
+            assert run("-K", cache, "60", "-u", "nobody:nogroup", "whoami") == "nobody"
+
     def test_nice_dec():
         value = -random.randint(0, 10)
         assert run("-n", str(value), "nice") == str(os.nice(0) + value)
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_MAX 32
+
+/* every mark reads the counter and calls getrusage(), both counted in the next phase */
+#define TRACE_OVERHEAD 2
+
+
+struct phase {
+	const char *name;
+	long long   end;      /* µs since trace_start() */
+	long long   syscalls; /* -1 if not counted */
+	long        nvcsw, nivcsw;
+};
+
+static const char *tracepoints[] = {
+	"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+	"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+};
+
+static struct timespec started;
+static long long       startsyscalls;
+static long            startnvcsw, startnivcsw;
+static struct phase    phases[TRACE_MAX];
+static int             nphases;
+static int             trace_chrome;
+static int             tracefd = -1, counterfd = -1;
+
+
+static long long elapsed(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - started.tv_sec) * 1000000LL + (now.tv_nsec - started.tv_nsec) / 1000;
+}
+
+static long long counter(void) {
+	long long count;
+
+	if (counterfd == -1 || read(counterfd, &count, sizeof(count)) != sizeof(count))
+		return -1;
+	return count;
+}
+
+/* count the syscalls of this process using the raw_syscalls tracepoint, -1 if unavailable */
+static int open_counter(void) {
+	struct perf_event_attr attr = { .type = PERF_TYPE_TRACEPOINT, .size = sizeof(attr) };
+	FILE                  *fp;
+	int                    fd;
+
+	for (size_t i = 0; i < sizeof(tracepoints) / sizeof(*tracepoints); i++) {
+		if ((fp = fopen(tracepoints[i], "re")) == NULL)
+			continue;
+		if (fscanf(fp, "%llu", &attr.config) != 1)
+			attr.config = 0;
+		fclose(fp);
+		if (attr.config != 0)
+			break;
+	}
+	if (attr.config == 0)
+		return -1;
+
+	if ((fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC)) == -1)
+		return -1;
+	return fd;
+}
+
+static void atexit_trace(void) {
+	trace_end("exit");
+}
+
+/* remember when envmod started, before anything else is done */
+void trace_start(void) {
+	clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+/* parse `[chrome:]dest` of -D and open dest right away, before chroot or dropping privileges */
+void trace_parse(char *spec) {
+	struct rusage ru;
+
+	if (tracefd != -1) {
+		fprintf(stderr, "%s: only one trace (-D) is supported\n", self);
+		exit(100);
+	}
+
+	if (!strncmp(spec, "chrome:", 7)) {
+		trace_chrome = 1;
+		spec += 7;
+	}
+	if (!*spec || !strcmp(spec, "-")) {
+		tracefd = STDERR_FILENO;
+	} else {
+		/* a chrome-trace is a single document, json-lines are collected */
+		tracefd = open(spec, O_WRONLY | O_CREAT | O_CLOEXEC | (trace_chrome ? O_TRUNC : O_APPEND), 0644);
+		if ((tracefd = movefd(tracefd, 1)) == -1)
+			FAIL_ERRNO(101, "unable to open trace `%s`", spec);
+	}
+
+	counterfd     = movefd(open_counter(), 1);
+	startsyscalls = counter();
+	getrusage(RUSAGE_SELF, &ru);
+	startnvcsw  = ru.ru_nvcsw;
+	startnivcsw = ru.ru_nivcsw;
+
+	atexit(atexit_trace);
+}
+
+/* end the current phase of main(), name describes what was done since the previous mark */
+void trace_mark(const char *name) {
+	struct phase *ph;
+	struct rusage ru;
+
+	if (tracefd == -1 || nphases == TRACE_MAX)
+		return;
+
+	ph           = &phases[nphases++];
+	ph->name     = name;
+	ph->end      = elapsed();
+	ph->syscalls = counter();
+	getrusage(RUSAGE_SELF, &ru);
+	ph->nvcsw  = ru.ru_nvcsw;
+	ph->nivcsw = ru.ru_nivcsw;
+}
+
+/* search file in PATH like execvpe() does, which happens after the trace is written,
+ * so a slow lookup (e.g. on a network filesystem) shows up as its own phase */
+void trace_lookup(const char *file) {
+	const char *path, *next;
+	char        buf[4096];
+	size_t      len;
+
+	if (tracefd == -1)
+		return;
+
+	if (strchr(file, '/') == NULL && (path = getenv("PATH")) != NULL) {
+		for (; *path; path = next + (*next == ':')) {
+			if ((next = strchr(path, ':')) == NULL)
+				next = path + strlen(path);
+			len = next - path;
+			snprintf(buf, sizeof(buf), "%.*s/%s", len ? (int) len : 1, len ? path : ".", file);
+			if (access(buf, X_OK) == 0)
+				break;
+		}
+	}
+	trace_mark("path");
+}
+
+/* mark the last phase and write the trace, called right before exec'ing or on exit */
+void trace_end(const char *name) {
+	FILE     *fp;
+	long long start = 0, syscalls, prevsyscalls = startsyscalls;
+	long      prevnvcsw = startnvcsw, prevnivcsw = startnivcsw;
+
+	if (tracefd == -1)
+		return;
+	trace_mark(name);
+
+	/* write through a duplicate, tracefd may be stderr which must stay open */
+	if ((fp = fdopen(dup(tracefd), "w")) == NULL) {
+		tracefd = -1;
+		return;
+	}
+
+	if (trace_chrome)
+		fprintf(fp, "{\"traceEvents\":[\n");
+	else
+		fprintf(fp, "{\"pid\":%d,\"total_us\":%lld,\"phases\":[", getpid(), phases[nphases - 1].end);
+
+	for (int i = 0; i < nphases; i++) {
+		struct phase *ph = &phases[i];
+
+		syscalls = -1;
+		if (ph->syscalls != -1 && prevsyscalls != -1) {
+			syscalls = ph->syscalls - prevsyscalls - TRACE_OVERHEAD;
+			if (syscalls < 0)
+				syscalls = 0;
+		}
+
+		if (trace_chrome) {
+			fprintf(fp,
+			        "%s{\"name\":\"%s\",\"cat\":\"envmod\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+			        "\"args\":{\"nvcsw\":%ld,\"nivcsw\":%ld",
+			        i ? ",\n" : "", ph->name, getpid(), getpid(), start, ph->end - start, ph->nvcsw - prevnvcsw,
+			        ph->nivcsw - prevnivcsw);
+		} else {
+			fprintf(fp, "%s{\"name\":\"%s\",\"start_us\":%lld,\"dur_us\":%lld,\"nvcsw\":%ld,\"nivcsw\":%ld",
+			        i ? "," : "", ph->name, start, ph->end - start, ph->nvcsw - prevnvcsw, ph->nivcsw - prevnivcsw);
+		}
+		if (syscalls != -1)
+			fprintf(fp, ",\"syscalls\":%lld", syscalls);
+		fprintf(fp, "}%s", trace_chrome ? "}" : "");
+
+		start        = ph->end;
+		prevsyscalls = ph->syscalls;
+		prevnvcsw    = ph->nvcsw;
+		prevnivcsw   = ph->nivcsw;
+	}
+
+	fprintf(fp, trace_chrome ? "\n]}\n" : "]}\n");
+	fclose(fp);
+
+	if (counterfd != -1)
+		close(counterfd);
+	if (tracefd != STDERR_FILENO)
+		close(tracefd);
+	tracefd = counterfd = -1;
+}
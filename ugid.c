@@ -0,0 +1,504 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the lookup-cache is rewritten with only its fresh entries once it grows beyond this */
+#define UGIDCACHE_COMPACT (64 * 1024)
+#define UGIDCACHE_VALUE   4096
+
+
+struct mapped {
+	const char *data;
+	size_t      size;
+	int         loaded;
+};
+
+struct gidlist {
+	gid_t *gids;
+	int    len, alloc;
+};
+
+int         ugid_files      = 0;
+int         ugid_initgroups = 0;
+const char *ugid_cache      = NULL;
+long        ugid_cachettl   = 0;
+
+static struct mapped passwdmap, groupmap;
+
+
+static void mapfd(int fd, struct mapped *map) {
+	struct stat st;
+	void       *data;
+
+	map->loaded = 1;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+	    (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+		map->data = data;
+		map->size = st.st_size;
+	}
+}
+
+static const struct mapped *mapfile(const char *path, struct mapped *map) {
+	int fd;
+
+	if (map->loaded)
+		return map;
+	map->loaded = 1;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return map;
+	mapfd(fd, map);
+	close(fd);
+	return map;
+}
+
+/* split the line [p, end) into at most n `sep`-separated fields, returns the number of fields */
+static int splitfields(const char *p, const char *end, const char **fields, size_t *lens, int n, char sep) {
+	const char *next;
+	int         i = 0;
+
+	while (i < n) {
+		if ((next = memchr(p, sep, end - p)) == NULL)
+			next = end;
+		fields[i]  = p;
+		lens[i++] = next - p;
+		if (next == end)
+			break;
+		p = next + 1;
+	}
+	return i;
+}
+
+static int fieldeq(const char *field, size_t len, const char *str) {
+	return strlen(str) == len && memcmp(field, str, len) == 0;
+}
+
+static int parseid(const char *field, size_t len, unsigned long *id) {
+	*id = 0;
+	if (len == 0)
+		return -1;
+	for (size_t i = 0; i < len; i++) {
+		if (field[i] < '0' || field[i] > '9')
+			return -1;
+		*id = *id * 10 + (field[i] - '0');
+	}
+	return 0;
+}
+
+static void gidlist_add(struct gidlist *list, gid_t gid) {
+	gid_t *newgids;
+
+	for (int i = 0; i < list->len; i++) {
+		if (list->gids[i] == gid)
+			return;
+	}
+	if (list->len == list->alloc) {
+		list->alloc = list->alloc ? list->alloc * 2 : 16;
+		if ((newgids = realloc(list->gids, list->alloc * sizeof(*newgids))) == NULL) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		list->gids = newgids;
+	}
+	list->gids[list->len++] = gid;
+}
+
+/* call fn for every line of the mapped file until it returns non-zero */
+static int eachline(const struct mapped *map, int nfields, int (*fn)(const char **, size_t *, int, void *),
+                    void *arg) {
+	const char *p = map->data, *end = map->data + map->size, *eol;
+	const char *fields[4];
+	size_t      lens[4];
+	int         n, ret;
+
+	for (; p < end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		if (p == eol || *p == '#')
+			continue;
+		n = splitfields(p, eol, fields, lens, nfields, ':');
+		if ((ret = fn(fields, lens, n, arg)) != 0)
+			return ret;
+	}
+	return 0;
+}
+
+struct userquery {
+	const char   *name;
+	unsigned long uid, gid;
+	char         *found; /* name of the user when searching by uid */
+};
+
+static int match_user(const char **fields, size_t *lens, int n, void *arg) {
+	struct userquery *query = arg;
+	unsigned long     uid, gid;
+
+	if (n < 4 || parseid(fields[2], lens[2], &uid) == -1 || parseid(fields[3], lens[3], &gid) == -1)
+		return 0;
+
+	if (query->name != NULL && !fieldeq(fields[0], lens[0], query->name))
+		return 0;
+	if (query->name == NULL) {
+		if (uid != query->uid)
+			return 0;
+		if ((query->found = strndup(fields[0], lens[0])) == NULL) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+	}
+
+	query->uid = uid;
+	query->gid = gid;
+	return 1;
+}
+
+static int match_group(const char **fields, size_t *lens, int n, void *arg) {
+	struct userquery *query = arg;
+	unsigned long     gid;
+
+	if (n < 3 || !fieldeq(fields[0], lens[0], query->name) || parseid(fields[2], lens[2], &gid) == -1)
+		return 0;
+
+	query->gid = gid;
+	return 1;
+}
+
+struct memberquery {
+	const char     *user;
+	struct gidlist *list;
+};
+
+static int match_member(const char **fields, size_t *lens, int n, void *arg) {
+	struct memberquery *query = arg;
+	const char         *member, *end, *comma;
+	unsigned long       gid;
+
+	if (n < 4 || parseid(fields[2], lens[2], &gid) == -1)
+		return 0;
+
+	for (member = fields[3], end = fields[3] + lens[3]; member < end; member = comma + 1) {
+		if ((comma = memchr(member, ',', end - member)) == NULL)
+			comma = end;
+		if (fieldeq(member, comma - member, query->user)) {
+			gidlist_add(query->list, gid);
+			break;
+		}
+	}
+	return 0;
+}
+
+/* lookup-cache: lines of `kind key time value`, where kind is u(ser), g(roup), m(embership) or n(ame) */
+
+static int cache_trusted(int fd) {
+	struct stat st;
+
+	/* a cache anyone else can write to could map names to arbitrary ids */
+	return fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (st.st_uid == 0 || st.st_uid == geteuid()) &&
+	       !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+static int cache_get(char kind, const char *key, char *value, size_t size) {
+	struct mapped map = { 0 };
+	const char   *p, *end, *eol, *fields[4];
+	size_t        lens[4];
+	unsigned long stamp;
+	time_t        now = time(NULL);
+	int           fd, found = -1;
+
+	if (ugid_cache == NULL || (fd = open(ugid_cache, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	if (!cache_trusted(fd)) {
+		if (verbose)
+			fprintf(stderr, "%s: ignoring untrusted lookup-cache `%s`\n", self, ugid_cache);
+		close(fd);
+		return -1;
+	}
+	mapfd(fd, &map);
+	close(fd);
+
+	for (p = map.data, end = map.data + map.size; p && p < end && found == -1; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			break; /* incomplete line of a concurrent writer */
+		if (splitfields(p, eol, fields, lens, 4, ' ') != 4 || lens[0] != 1 || fields[0][0] != kind ||
+		    !fieldeq(fields[1], lens[1], key) || parseid(fields[2], lens[2], &stamp) == -1 ||
+		    (time_t) stamp + ugid_cachettl < now || lens[3] >= size)
+			continue;
+		memcpy(value, fields[3], lens[3]);
+		value[lens[3]] = '\0';
+		found          = 0;
+	}
+
+	if (map.data)
+		munmap((void *) map.data, map.size);
+	return found;
+}
+
+static int cache_compact(int fd, time_t now) {
+	struct mapped map = { 0 };
+	const char   *p, *end, *eol, *fields[4];
+	size_t        lens[4];
+	unsigned long stamp;
+	char          tmppath[PATH_MAX];
+	FILE         *fp;
+	int           tmpfd;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.%d", ugid_cache, getpid());
+	if ((tmpfd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+		return -1;
+	if ((fp = fdopen(tmpfd, "w")) == NULL) {
+		close(tmpfd);
+		unlink(tmppath);
+		return -1;
+	}
+
+	mapfd(fd, &map);
+	for (p = map.data, end = map.data + map.size; p && p < end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			break;
+		if (splitfields(p, eol, fields, lens, 4, ' ') == 4 && parseid(fields[2], lens[2], &stamp) == 0 &&
+		    (time_t) stamp + ugid_cachettl >= now)
+			fwrite(p, eol - p + 1, 1, fp);
+	}
+	if (map.data)
+		munmap((void *) map.data, map.size);
+
+	if (fclose(fp) == 0 && rename(tmppath, ugid_cache) == 0)
+		return 0;
+	unlink(tmppath);
+	return -1;
+}
+
+static void cache_put(char kind, const char *key, const char *value) {
+	char        line[UGIDCACHE_VALUE + 128];
+	struct stat st;
+	time_t      now = time(NULL);
+	int         fd, len;
+
+	if (ugid_cache == NULL || strpbrk(key, " \n") != NULL)
+		return;
+
+	len = snprintf(line, sizeof(line), "%c %s %ld %s\n", kind, key, (long) now, value);
+	if (len < 0 || (size_t) len >= sizeof(line))
+		return;
+
+	if ((fd = open(ugid_cache, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		if (verbose)
+			FAIL_ERRNO(-1, "unable to write lookup-cache `%s`", ugid_cache);
+		return;
+	}
+	if (!cache_trusted(fd)) {
+		close(fd);
+		return;
+	}
+	if (fstat(fd, &st) == 0 && st.st_size > UGIDCACHE_COMPACT && cache_compact(fd, now) == 0) {
+		close(fd);
+		if ((fd = open(ugid_cache, O_WRONLY | O_APPEND | O_CLOEXEC)) == -1)
+			return;
+	}
+	/* a single append of a short line is atomic for concurrent writers */
+	write(fd, line, len);
+	close(fd);
+}
+
+static int lookup_user(const char *name, uid_t *uid, gid_t *gid) {
+	struct userquery query = { .name = name };
+	struct passwd   *pwd;
+	char             value[UGIDCACHE_VALUE];
+
+	if (cache_get('u', name, value, sizeof(value)) == 0 && sscanf(value, "%lu,%lu", &query.uid, &query.gid) == 2) {
+		*uid = query.uid;
+		*gid = query.gid;
+		return 0;
+	}
+
+	if (!ugid_nss) {
+		if (!eachline(mapfile(PASSWD_PATH, &passwdmap), 4, match_user, &query))
+			return -1;
+		*uid = query.uid;
+		*gid = query.gid;
+	} else {
+		if ((pwd = getpwnam(name)) == NULL)
+			return -1;
+		*uid = pwd->pw_uid;
+		*gid = pwd->pw_gid;
+	}
+
+	snprintf(value, sizeof(value), "%u,%u", *uid, *gid);
+	cache_put('u', name, value);
+	return 0;
+}
+
+static int lookup_group(const char *name, gid_t *gid) {
+	struct userquery query = { .name = name };
+	struct group    *gr;
+	char             value[UGIDCACHE_VALUE];
+
+	if (cache_get('g', name, value, sizeof(value)) == 0 && sscanf(value, "%lu", &query.gid) == 1) {
+		*gid = query.gid;
+		return 0;
+	}
+
+	if (!ugid_nss) {
+		if (!eachline(mapfile(GROUP_PATH, &groupmap), 3, match_group, &query))
+			return -1;
+		*gid = query.gid;
+	} else {
+		if ((gr = getgrnam(name)) == NULL)
+			return -1;
+		*gid = gr->gr_gid;
+	}
+
+	snprintf(value, sizeof(value), "%u", *gid);
+	cache_put('g', name, value);
+	return 0;
+}
+
+/* name of the user with uid, NULL if there is none */
+static char *lookup_username(uid_t uid) {
+	struct userquery query = { .uid = uid };
+	struct passwd   *pwd;
+	char             key[16], value[UGIDCACHE_VALUE];
+
+	snprintf(key, sizeof(key), "%u", uid);
+	if (cache_get('n', key, value, sizeof(value)) == 0)
+		return strdup(value);
+
+	if (!ugid_nss) {
+		eachline(mapfile(PASSWD_PATH, &passwdmap), 4, match_user, &query);
+	} else if ((pwd = getpwuid(uid)) != NULL) {
+		query.found = strdup(pwd->pw_name);
+	}
+
+	if (query.found)
+		cache_put('n', key, query.found);
+	return query.found;
+}
+
+/* add every group user is a member of, like initgroups(3) */
+static void lookup_members(const char *user, gid_t basegid, struct gidlist *list) {
+	struct gidlist     members = { 0 };
+	struct memberquery query   = { user, &members };
+	char               value[UGIDCACHE_VALUE], *p, *end;
+	gid_t             *groups;
+	int                ngroups = 64, len, off = 0;
+
+	if (cache_get('m', user, value, sizeof(value)) == 0) {
+		for (p = value; *p; p = *end ? end + 1 : end) {
+			gidlist_add(list, strtoul(p, &end, 10));
+			if (end == p)
+				break;
+		}
+		return;
+	}
+
+	if (!ugid_nss) {
+		eachline(mapfile(GROUP_PATH, &groupmap), 4, match_member, &query);
+	} else {
+		if ((groups = malloc(ngroups * sizeof(*groups))) == NULL) {
+			FAIL_ERRNO(102, "unable to allocate memory");
+		}
+		if (getgrouplist(user, basegid, groups, &ngroups) == -1) {
+			if ((groups = realloc(groups, ngroups * sizeof(*groups))) == NULL) {
+				FAIL_ERRNO(102, "unable to allocate memory");
+			}
+			getgrouplist(user, basegid, groups, &ngroups);
+		}
+		/* basegid is always part of the result, it is no membership of its own */
+		for (int i = 0; i < ngroups; i++) {
+			if (groups[i] != basegid)
+				gidlist_add(&members, groups[i]);
+		}
+		free(groups);
+	}
+
+	value[0] = '\0';
+	for (int i = 0; i < members.len; i++) {
+		gidlist_add(list, members.gids[i]);
+		if (off < 0)
+			continue;
+		len = snprintf(value + off, sizeof(value) - off, i ? ",%u" : "%u", members.gids[i]);
+		/* too many groups to cache */
+		off = len < 0 || (size_t) (off + len) >= sizeof(value) ? -1 : off + len;
+	}
+	if (off >= 0)
+		cache_put('m', user, value);
+	free(members.gids);
+}
+
+/* [:]user[:group[:group]...], returns the number of groups stored in *gids */
+int parse_ugid(char *str, uid_t *uid, gid_t **gids) {
+	struct gidlist list = { 0 };
+	char          *end, *next, *groupstr = NULL, *user = NULL;
+	gid_t          gid;
+
+	if (str[0] == ':') {
+		str++;
+		*uid = strtoul(str, &end, 10);
+		if (*end != ':') {
+			gidlist_add(&list, *uid);
+		} else {
+			do {
+				str = end + 1;
+				gidlist_add(&list, strtoul(str, &end, 10));
+			} while (*end == ':');
+		}
+
+		if (*end != '\0') {
+			fprintf(stderr, "%s: expected end in uidgid, got %c\n", self, *end);
+			exit(100);
+		}
+
+		if (ugid_initgroups && (user = lookup_username(*uid)) != NULL) {
+			lookup_members(user, list.gids[0], &list);
+			free(user);
+		}
+
+		*gids = list.gids;
+		return list.len;
+	}
+
+	/* split a copy, str stays intact for the profile of -@ */
+	if ((str = strdup(str)) == NULL)
+		FAIL_ERRNO(102, "unable to allocate memory");
+	if ((end = strchr(str, ':')) != NULL) {
+		end[0]   = '\0';
+		groupstr = end + 1;
+	}
+
+	if (lookup_user(str, uid, &gid) == -1) {
+		fprintf(stderr, "%s: unknown user: %s\n", self, str);
+		exit(101);
+	}
+
+	if (groupstr == NULL)
+		gidlist_add(&list, gid);
+
+	for (next = groupstr; next;) {
+		groupstr = next;
+		if ((end = strchr(groupstr, ':')) != NULL) {
+			end[0] = '\0';
+			next   = end + 1;
+		} else {
+			next = NULL;
+		}
+		if (lookup_group(groupstr, &gid) == -1) {
+			fprintf(stderr, "%s: unknown group: %s\n", self, groupstr);
+			exit(101);
+		}
+		gidlist_add(&list, gid);
+	}
+
+	if (ugid_initgroups)
+		lookup_members(str, list.gids[0], &list);
+	free(str);
+
+	*gids = list.gids;
+	return list.len;
+}
@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+int uring_init(struct uring *ring, unsigned entries) {
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	if ((ring->fd = syscall(SYS_io_uring_setup, entries, &params)) == -1)
+		return -1;
+
+	ring->entries    = params.sq_entries;
+	ring->sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqessize   = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqringsize > ring->sqringsize)
+			ring->sqringsize = ring->cqringsize;
+		ring->cqringsize = ring->sqringsize;
+	}
+
+	ring->sqring = mmap(NULL, ring->sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+	                    IORING_OFF_SQ_RING);
+	if (ring->sqring == MAP_FAILED)
+		goto fail;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cqring = ring->sqring;
+	} else {
+		ring->cqring = mmap(NULL, ring->cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+		                    IORING_OFF_CQ_RING);
+		if (ring->cqring == MAP_FAILED) {
+			ring->cqring = NULL;
+			goto fail;
+		}
+	}
+
+	ring->sqes = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+	                  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	ring->sqhead  = (unsigned *) ((char *) ring->sqring + params.sq_off.head);
+	ring->sqtail  = (unsigned *) ((char *) ring->sqring + params.sq_off.tail);
+	ring->sqmask  = (unsigned *) ((char *) ring->sqring + params.sq_off.ring_mask);
+	ring->sqarray = (unsigned *) ((char *) ring->sqring + params.sq_off.array);
+	ring->cqhead  = (unsigned *) ((char *) ring->cqring + params.cq_off.head);
+	ring->cqtail  = (unsigned *) ((char *) ring->cqring + params.cq_off.tail);
+	ring->cqmask  = (unsigned *) ((char *) ring->cqring + params.cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe *) ((char *) ring->cqring + params.cq_off.cqes);
+
+	return 0;
+
+fail:
+	if (ring->sqring == MAP_FAILED)
+		ring->sqring = NULL;
+	uring_free(ring);
+	return -1;
+}
+
+/* check if the kernel knows all of the opcodes in ops */
+int uring_supported(struct uring *ring, const int *ops, int nops) {
+	struct io_uring_probe *probe;
+	size_t                 size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	int                    supported = 1;
+
+	if ((probe = calloc(1, size)) == NULL)
+		return 0;
+
+	if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+		free(probe);
+		return 0;
+	}
+
+	for (int i = 0; i < nops && supported; i++) {
+		supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	free(probe);
+	return supported;
+}
+
+/* get the next free submission-entry, NULL if the queue is full */
+struct io_uring_sqe *uring_sqe(struct uring *ring) {
+	unsigned             head = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+	unsigned             tail = *ring->sqtail + ring->sqpending;
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= ring->entries)
+		return NULL;
+
+	sqe = &ring->sqes[tail & *ring->sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqarray[tail & *ring->sqmask] = tail & *ring->sqmask;
+	ring->sqpending++;
+	return sqe;
+}
+
+/* submit all pending entries and wait for at least `wait` completions */
+int uring_submit(struct uring *ring, unsigned wait) {
+	unsigned submit = ring->sqpending;
+	int      ret;
+
+	__atomic_store_n(ring->sqtail, *ring->sqtail + ring->sqpending, __ATOMIC_RELEASE);
+	ring->sqpending = 0;
+
+	while ((ret = syscall(SYS_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) ==
+	       -1) {
+		if (errno != EINTR)
+			return -1;
+		submit = 0;
+	}
+	return ret;
+}
+
+/* peek at the next completion, NULL if there is none */
+struct io_uring_cqe *uring_cqe(struct uring *ring) {
+	unsigned head = *ring->cqhead;
+
+	if (head == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cqmask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+	__atomic_store_n(ring->cqhead, *ring->cqhead + 1, __ATOMIC_RELEASE);
+}
+
+void uring_free(struct uring *ring) {
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqessize);
+	if (ring->cqring && ring->cqring != ring->sqring)
+		munmap(ring->cqring, ring->cqringsize);
+	if (ring->sqring)
+		munmap(ring->sqring, ring->sqringsize);
+	if (ring->fd != -1)
+		close(ring->fd);
+	ring->fd = -1;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/* minimal io_uring ring, just enough to submit batches and reap their completions */
+struct uring {
+	int                  fd;
+	unsigned             entries;
+	unsigned            *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned            *cqhead, *cqtail, *cqmask;
+	unsigned             sqpending;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void                *sqring, *cqring;
+	size_t               sqringsize, cqringsize, sqessize;
+};
+
+int                  uring_init(struct uring *ring, unsigned entries);
+int                  uring_supported(struct uring *ring, const int *ops, int nops);
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+int                  uring_submit(struct uring *ring, unsigned wait);
+struct io_uring_cqe *uring_cqe(struct uring *ring);
+void                 uring_cqe_seen(struct uring *ring);
+void                 uring_free(struct uring *ring);
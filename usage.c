@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+
+#include "envmod.h"
+#include "signames.h"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+const char *usage_report; /* destination of -z, NULL if not reporting */
+
+static int  usage_json;
+static FILE *usage_fp;
+
+
+/* parse `[json:]dest` of -z, dest is a file or `-` for stderr */
+void usage_parse(char *spec) {
+	if (!strncmp(spec, "json:", 5)) {
+		usage_json = 1;
+		spec += 5;
+	}
+	usage_report = *spec ? spec : "-";
+}
+
+/* open the destination, called once everything is set up, like the lock of -l */
+void usage_open(void) {
+	int fd;
+
+	if (usage_report == NULL || usage_fp != NULL)
+		return;
+
+	if (!strcmp(usage_report, "-")) {
+		usage_fp = stderr;
+		return;
+	}
+	if ((fd = open(usage_report, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1 ||
+	    (usage_fp = fdopen(fd, "a")) == NULL)
+		FAIL_ERRNO(101, "unable to open usage-report `%s`", usage_report);
+}
+
+/* read the I/O counters of an exited but not yet reaped process, -1 if unknown */
+void usage_readio(pid_t pid, struct iousage *io) {
+	char  path[32], line[128];
+	FILE *fp;
+
+	io->rchar = io->wchar = io->read_bytes = io->write_bytes = -1;
+
+	snprintf(path, sizeof(path), "/proc/%d/io", pid);
+	if ((fp = fopen(path, "re")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		sscanf(line, "rchar: %lld", &io->rchar);
+		sscanf(line, "wchar: %lld", &io->wchar);
+		sscanf(line, "read_bytes: %lld", &io->read_bytes);
+		sscanf(line, "write_bytes: %lld", &io->write_bytes);
+	}
+	fclose(fp);
+}
+
+static double seconds(const struct timeval *tv) {
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* report the resources used by the child pid, worker is -1 unless preforking */
+void usage_print(int worker, pid_t pid, int status, double wall, const struct rusage *ru, const struct iousage *io) {
+	char how[64];
+
+	if (usage_fp == NULL)
+		return;
+
+	if (WIFEXITED(status))
+		snprintf(how, sizeof(how), "exited %d", WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+		snprintf(how, sizeof(how), "terminated using %s", signum_to_signame(WTERMSIG(status)));
+	else
+		snprintf(how, sizeof(how), "terminated");
+
+	if (usage_json) {
+		fprintf(usage_fp, "{\"pid\":%d,", pid);
+		if (worker >= 0)
+			fprintf(usage_fp, "\"worker\":%d,", worker);
+		if (WIFEXITED(status))
+			fprintf(usage_fp, "\"exit\":%d,", WEXITSTATUS(status));
+		else if (WIFSIGNALED(status))
+			fprintf(usage_fp, "\"signal\":\"%s\",", signum_to_signame(WTERMSIG(status)));
+		fprintf(usage_fp,
+		        "\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,\"majflt\":%ld,\"minflt\":%ld,"
+		        "\"nvcsw\":%ld,\"nivcsw\":%ld,\"rchar\":%lld,\"wchar\":%lld,\"read_bytes\":%lld,\"write_bytes\":%lld}\n",
+		        wall, seconds(&ru->ru_utime), seconds(&ru->ru_stime), ru->ru_maxrss, ru->ru_majflt, ru->ru_minflt,
+		        ru->ru_nvcsw, ru->ru_nivcsw, io->rchar, io->wchar, io->read_bytes, io->write_bytes);
+	} else {
+		fprintf(usage_fp, "%s: child %d %s", self, pid, how);
+		if (worker >= 0)
+			fprintf(usage_fp, " (worker %d)", worker);
+		fprintf(usage_fp,
+		        ": %.3fs wall, %.3fs user, %.3fs sys, %ld KiB max-rss, %ld major + %ld minor faults, "
+		        "%ld voluntary + %ld involuntary context-switches, %lld bytes read (%lld from storage), "
+		        "%lld bytes written (%lld to storage)\n",
+		        wall, seconds(&ru->ru_utime), seconds(&ru->ru_stime), ru->ru_maxrss, ru->ru_majflt, ru->ru_minflt,
+		        ru->ru_nvcsw, ru->ru_nivcsw, io->rchar, io->read_bytes, io->wchar, io->write_bytes);
+	}
+	fflush(usage_fp);
+}